@@ -0,0 +1,36 @@
+#ifndef COMMON_H_
+#define COMMON_H_
+
+#include <ctype.h>
+#include <stddef.h>
+#include <cstdint>
+#include <chrono>
+
+static inline bool str_to_int64(const char *str, size_t len, std::int64_t *res)
+{
+    *res = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!isdigit(str[i])) return false;
+        *res = *res*10 + (str[i]-'0');
+    }
+
+    return true;
+}
+
+// Chat ids of groups and channels are negative
+static inline bool parse_chat_id(const char *str, size_t len, std::int64_t *res)
+{
+    bool negative = len > 0 && str[0] == '-';
+    if (negative) { str += 1; len -= 1; }
+    if (len == 0 || !str_to_int64(str, len, res)) return false;
+    if (negative) *res = -*res;
+    return true;
+}
+
+static inline double now_seconds()
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+#endif // COMMON_H_
@@ -0,0 +1,2317 @@
+#ifndef GENERATOR_H_
+#define GENERATOR_H_
+
+#include <stdio.h>
+#include <assert.h>
+#include <math.h>
+#include <fstream>
+#include <string.h>
+#include <clocale>
+#include <ctime>
+#include <random>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include <llama.h>
+
+#include "common.h"
+#include "retrieval.h"
+#include "pager.h"
+
+#define LLAMA_GPU_LAYER_COUNT 99
+#define LLAMA_CONTEXT_SIZE    2048
+#define LLAMA_SEQUENCES       4
+#define LLAMA_RAG_TOP_K       4
+#define LLAMA_RAG_WINDOW      8
+// 1 - largest free run/free cells of the KV cache above which it is defragmented when idle
+#define LLAMA_DEFRAG_THRESHOLD 0.2
+#define LLAMA_PREFILL_CHUNK    64   // tokens of observed messages decoded along with every step
+#define LLAMA_MEASURE_TOKENS   32   // decoded at startup to measure the KV cache per token
+// Part of the context share of one sequence (n_ctx/n_seq) the prompt of a chat
+// may take, the rest is left for the reply. Past it the oldest messages are
+// dropped down to LLAMA_HISTORY_TRIM
+#define LLAMA_HISTORY_MAX      0.75
+#define LLAMA_HISTORY_TRIM     0.5
+
+// Past this part of the token or time budget the generation stops at the
+// first end of a sentence
+#define GEN_SENTENCE_GRACE    0.8
+
+// A reply that generates the same LOOP_NGRAM tokens LOOP_REPEATS times is stuck in a loop
+#define LOOP_NGRAM            8
+#define LOOP_REPEATS          3
+#define LOOP_HASH_BASE        1000003ull
+#define LOOP_PENALTY          1.3f
+#define LOOP_PENALTY_LAST_N   64
+
+#define CASCADE_LONG_MESSAGE  200  // bytes
+#define CASCADE_CONFIDENCE    0.5
+
+// Filled while generating so callers can measure the generation without
+// knowing which generator they are talking to
+struct Gen_Stats {
+    std::int64_t n_prompt_tokens;
+    std::int64_t n_gen_tokens;
+    double t_first_token; // seconds from `begin`
+    double log_prob;      // of the generated tokens, only with `Gen_Request::score`
+    std::int64_t n_loops; // repetition loops detected
+};
+
+enum Gen_Status {
+    GEN_RUNNING,
+    GEN_DONE,
+    GEN_CANCELLED,
+    GEN_DEADLINE,
+    GEN_LIMIT,     // `max_tokens` generated
+    GEN_ERROR,
+};
+
+// A message of the conversation from before we started
+struct Gen_Message {
+    std::int64_t message_id;
+    bool own;
+    std::string text;
+};
+
+// Handle of one generation. It is driven by `Generator::begin` + `Generator::step`
+// and must stay alive until the status is not `GEN_RUNNING`
+struct Gen_Request {
+    std::int64_t chat_id = 0;
+    std::int64_t message_id = 0; // of the input, to follow its edits
+    std::int64_t thread_id = 0;  // reply thread or forum topic, 0 for the main conversation
+    std::string input;
+    // Called with every generated piece of text, return false to cancel
+    std::function<bool(const char *piece, size_t len)> on_piece;
+    double deadline = 0.0;                // `now_seconds()` time, 0 means no deadline
+    std::int64_t max_tokens = 0;          // 0 means no limit
+    std::atomic<bool> cancelled = {false}; // may be set from any thread
+    bool score = false;                    // fill `stats.log_prob`
+    bool addressed = false;                // asked for: a mention, a reply to us, a private chat or a keyword
+
+    Gen_Status status = GEN_RUNNING;
+    std::string response;
+    Gen_Stats stats = {};
+    double t_start = 0.0;
+};
+
+struct Generator {
+    llama_model *model = nullptr;
+    const llama_vocab *vocab = nullptr;
+    llama_context *ctx = nullptr;
+    llama_sampler *smpl = nullptr;
+    std::vector<llama_chat_message> messages;
+    std::vector<char> formatted;
+
+    std::uint32_t seed = LLAMA_DEFAULT_SEED; // must be set before `load`
+
+    virtual ~Generator() {}
+
+    virtual bool load(const char *file_path) = 0;
+    virtual bool parse_args(int argc, char **argv) = 0;
+
+    // Starts the generation of the response to `req.input` in `req.chat_id`.
+    // Up to `max_batch()` requests of different chats may be running at a time
+    virtual bool begin(Gen_Request &req) = 0;
+    // Generates the next piece, returns false when the request is finished
+    // (see `req.status`)
+    virtual bool step(Gen_Request &req) = 0;
+
+    // Steps every running request once. Only requests of the same batch
+    // group are stepped together, the others are left for the next call
+    virtual void step_batch(Gen_Request **reqs, size_t n_reqs)
+    {
+        for (size_t i = 0; i < n_reqs; i++) step(*reqs[i]);
+    }
+    virtual int batch_group(std::int64_t) { return 0; }
+    virtual size_t max_batch() { return 1; }
+    // Memory the conversation state takes per token of context, 0 if it doesn't grow with the context
+    virtual double bytes_per_token() { return 0.0; }
+    // Whether the reply depends on the input, otherwise `confidence` says
+    // nothing about how well it answers
+    virtual bool reads_input() { return true; }
+
+    // Someone is typing in the conversation: get it ready for the next
+    // `begin`. Only called while no request is running
+    virtual void prepare(std::int64_t, std::int64_t) {}
+
+    // A message of the conversation, answered or not. A `begin` with the
+    // same message id answers it without adding it again
+    virtual void observe(std::int64_t, std::int64_t, std::int64_t, bool, const std::string &) {}
+
+    // The history from before we started, oldest first. Comes before the
+    // observed messages of the conversation
+    virtual void backfill(std::int64_t chat_id, std::int64_t thread_id, const std::vector<Gen_Message> &messages)
+    {
+        for (const Gen_Message &m : messages) observe(chat_id, thread_id, m.message_id, m.own, m.text);
+    }
+
+    // Log-probability of `reply` as the answer to `input` after the
+    // conversation so far, fed token by token (teacher forcing). Neither is
+    // added to the conversation. Returns false if the generator can't tell
+    virtual bool score_reply(std::int64_t, std::int64_t, const std::string &, const std::string &,
+                             double *, std::int64_t *)
+    {
+        return false;
+    }
+
+    // A message of the history was edited or deleted in Telegram
+    virtual void edit_message(std::int64_t, std::int64_t, const std::string &) {}
+    virtual void delete_message(std::int64_t, std::int64_t) {}
+
+    // Nothing is running or waiting, a good time for housekeeping that would
+    // slow down the replies. Does a bit of it at a time and returns true when
+    // there is more, so new messages don't wait for all of it
+    virtual bool idle() { return false; }
+    virtual void print_stats(FILE *) {}
+
+    // Hands the conversations without a running request over to `to`, which
+    // replaces this generator. They are prefilled again when they are used
+    virtual void move_idle_chats(Generator *) {}
+    // Whether the conversation is still here, i.e. not handed over yet
+    virtual bool has_chat(std::int64_t, std::int64_t) { return false; }
+
+    // Called by `step` implementations before doing any work
+    bool should_stop(Gen_Request &req)
+    {
+        if (req.status != GEN_RUNNING) return true;
+        if (req.cancelled) {
+            req.status = GEN_CANCELLED;
+        } else if (req.deadline > 0.0 && now_seconds() >= req.deadline) {
+            req.status = GEN_DEADLINE;
+        } else if (req.max_tokens > 0 && req.stats.n_gen_tokens >= req.max_tokens) {
+            req.status = GEN_LIMIT;
+        }
+        // The budget ran out in the middle of a sentence, the unfinished one is dropped.
+        // Nothing may be left, then the caller has to come up with something else
+        if (req.status == GEN_DEADLINE || req.status == GEN_LIMIT) {
+            req.response.resize(sentence_end(req.response));
+        }
+        return req.status != GEN_RUNNING;
+    }
+
+    // End of the last complete sentence of `text`, 0 if there is none
+    static size_t sentence_end(const std::string &text)
+    {
+        for (size_t i = text.size(); i > 0; i--) {
+            char c = text[i - 1];
+            if (c == '\n') return i;
+            bool boundary = c == '.' || c == '!' || c == '?' ||
+                            (i >= 3 && text.compare(i - 3, 3, "\xe2\x80\xa6") == 0); // U+2026
+            if (boundary && (i == text.size() || isspace((unsigned char)text[i]))) return i;
+        }
+        return 0;
+    }
+
+    // Close to the end of its budget a request stops at the first end of a sentence
+    static bool in_grace(const Gen_Request &req)
+    {
+        if (req.max_tokens > 0 && req.stats.n_gen_tokens >= GEN_SENTENCE_GRACE*req.max_tokens) return true;
+        if (req.deadline > 0.0 && now_seconds() - req.t_start >= GEN_SENTENCE_GRACE*(req.deadline - req.t_start)) return true;
+        return false;
+    }
+
+    // Hands a generated piece over to the request, returns false if the request doesn't want more
+    bool emit(Gen_Request &req, const char *piece, size_t len)
+    {
+        if (req.stats.n_gen_tokens++ == 0) req.stats.t_first_token = now_seconds() - req.t_start;
+        req.response.append(piece, len);
+        if (req.on_piece && !req.on_piece(piece, len)) {
+            req.status = GEN_CANCELLED;
+            return false;
+        }
+        if (in_grace(req) && !req.response.empty() && sentence_end(req.response) == req.response.size()) {
+            req.status = GEN_DONE;
+            return false;
+        }
+        return true;
+    }
+
+    // Geometric mean of the probabilities of the generated tokens. Generators
+    // that can't tell are always sure
+    static double confidence(const Gen_Request &req)
+    {
+        if (req.stats.n_gen_tokens == 0) return 0.0;
+        return exp(req.stats.log_prob/req.stats.n_gen_tokens);
+    }
+
+    // Runs the request until it is finished
+    bool generate(Gen_Request &req)
+    {
+        if (!begin(req)) return false;
+        while (step(req)) {}
+        return req.status != GEN_ERROR;
+    }
+};
+
+struct BpeGenerator : Generator {
+    struct Token {
+        uint32_t value; // may be either `symbol` or `pair_id`
+        bool is_node;
+    };
+
+    struct Pair {
+        Token l, r;
+        size_t freq;
+    };
+
+    std::vector<Pair> pairs;
+    std::vector<Token> next;
+    std::int64_t gen_limit = 10;
+    std::minstd_rand rng;
+
+    // State of the running request
+    Token token;
+    bool has_token;
+    std::int64_t n_rendered;
+    std::wstring wpiece;
+    std::string piece;
+
+    // A random walk over the pairs, the input is never looked at
+    virtual bool reads_input() override { return false; }
+
+    virtual bool load(const char *path) override
+    {
+        puts("Loading bpe pairs...");
+
+        rng.seed(seed == LLAMA_DEFAULT_SEED ? time(0) : seed);
+
+        std::ifstream ifs(path);
+        std::string bytes((std::istreambuf_iterator<char>(ifs)),
+                          (std::istreambuf_iterator<char>()));
+
+        if (!ifs.good()) {
+            fprintf(stderr, "ERROR: Could not open file '%s'\n", path);
+            return false;
+        }
+
+        if (bytes.size()%sizeof(Pair) != 0) {
+            fprintf(stderr, "%s: file size in bytes (%zu) must be divisible by %zu\n", path, bytes.size(), sizeof(Pair));
+            return false;
+        }
+
+        Pair *items = (Pair *)bytes.c_str();
+        size_t count = bytes.size()/sizeof(Pair);
+        for (size_t i = 0; i < count; i++) {
+            pairs.push_back(items[i]);
+        }
+
+        return true;
+    }
+
+    virtual bool parse_args(int argc, char **argv) override
+    {
+        if (argc == 0) return true;
+        if (argc != 1) {
+            fprintf(stderr, "BPE ARGS: [generation-limit]\n");
+            return false;
+        }
+
+        if (!str_to_int64(argv[0], strlen(argv[0]), &gen_limit)) return false;
+
+        printf("Generation limit: %zu\n", gen_limit);
+
+        return true;
+    }
+
+    void render_token(std::vector<Pair> &pairs, Token token, std::wstring &dest)
+    {
+        if (!token.is_node) {
+            dest.push_back(token.value);
+        } else {
+            assert(token.value < pairs.size());
+            render_token(pairs, pairs[token.value].l, dest);
+            render_token(pairs, pairs[token.value].r, dest);
+        }
+    }
+
+    virtual bool begin(Gen_Request &req) override
+    {
+        req.t_start = now_seconds();
+        req.status = GEN_RUNNING;
+        req.response.clear();
+        req.stats = {};
+
+        if (pairs.size() == 0) {
+            fprintf(stderr, "ERROR: There are no bpe pairs to generate from\n");
+            req.status = GEN_ERROR;
+            return false;
+        }
+
+        token = {(uint32_t)rng()%(uint32_t)pairs.size(), true};
+        has_token = true;
+        n_rendered = 0;
+        return true;
+    }
+
+    virtual bool step(Gen_Request &req) override
+    {
+        if (should_stop(req)) return false;
+        if (!has_token || n_rendered >= gen_limit) {
+            req.status = GEN_DONE;
+            return false;
+        }
+
+        wpiece.clear();
+        render_token(pairs, token, wpiece);
+        n_rendered += 1;
+
+        next.clear();
+        while (true) {
+            for (size_t i = 0; i < pairs.size(); i++) {
+                if (memcmp(&pairs[i].l, &token, sizeof(token)) == 0) {
+                    next.push_back(pairs[i].r);
+                }
+            }
+            if (next.size() > 0) break;
+            if (!token.is_node) break;
+            token = pairs[token.value].r;
+        }
+
+        has_token = next.size() > 0;
+        if (has_token) token = next[rng()%next.size()];
+        if (has_token && req.score) req.stats.log_prob -= log((double)next.size());
+
+        size_t len = wcstombs(nullptr, wpiece.c_str(), 0);
+        if (len == (size_t)-1) {
+            fprintf(stderr, "ERROR: Could not convert some wide character\n");
+            req.status = GEN_ERROR;
+            return false;
+        }
+        piece.resize(len + 1);
+        wcstombs(&piece[0], wpiece.c_str(), len + 1);
+
+        return emit(req, piece.data(), len);
+    }
+};
+
+// Finds repeated n-grams of the generated tokens with a rolling hash
+struct Loop_Detector {
+    struct Seen {
+        std::uint32_t count;
+        std::uint32_t first_end; // index of the last token of the first occurrence
+    };
+
+    std::vector<std::uint32_t> tokens;
+    std::unordered_map<std::uint64_t, Seen> seen;
+    std::uint64_t hash = 0;  // of the last LOOP_NGRAM tokens
+    std::uint64_t power = 1; // LOOP_HASH_BASE^LOOP_NGRAM
+
+    void reset()
+    {
+        tokens.clear();
+        seen.clear();
+        hash = 0;
+        power = 1;
+        for (int i = 0; i < LOOP_NGRAM; i++) power *= LOOP_HASH_BASE;
+    }
+
+    std::uint64_t next_hash(std::uint32_t token) const
+    {
+        std::uint64_t h = hash*LOOP_HASH_BASE + token + 1;
+        if (tokens.size() >= LOOP_NGRAM) h -= (tokens[tokens.size() - LOOP_NGRAM] + 1ull)*power;
+        return h;
+    }
+
+    // Would the token complete the LOOP_REPEATS-th occurrence of an n-gram
+    bool is_loop(std::uint32_t token, std::uint32_t *first_end)
+    {
+        if (tokens.size() + 1 < LOOP_NGRAM) return false;
+        auto it = seen.find(next_hash(token));
+        if (it == seen.end() || it->second.count + 1 < LOOP_REPEATS) return false;
+
+        // Hash collisions are possible, the tokens are not
+        size_t start = it->second.first_end + 1 - LOOP_NGRAM;
+        if (tokens[it->second.first_end] != token) return false;
+        for (size_t i = 0; i + 1 < LOOP_NGRAM; i++) {
+            if (tokens[start + i] != tokens[tokens.size() - (LOOP_NGRAM - 1) + i]) return false;
+        }
+        *first_end = it->second.first_end;
+        return true;
+    }
+
+    void push(std::uint32_t token)
+    {
+        hash = next_hash(token);
+        tokens.push_back(token);
+        if (tokens.size() < LOOP_NGRAM) return;
+        Seen &s = seen[hash];
+        if (s.count++ == 0) s.first_end = tokens.size() - 1;
+    }
+};
+
+struct Llama_Cache_Type {
+    const char *name;
+    ggml_type type;
+};
+
+static const Llama_Cache_Type llama_cache_types[] = {
+    {"f32",    GGML_TYPE_F32},
+    {"f16",    GGML_TYPE_F16},
+    {"bf16",   GGML_TYPE_BF16},
+    {"q8_0",   GGML_TYPE_Q8_0},
+    {"q5_1",   GGML_TYPE_Q5_1},
+    {"q5_0",   GGML_TYPE_Q5_0},
+    {"q4_1",   GGML_TYPE_Q4_1},
+    {"q4_0",   GGML_TYPE_Q4_0},
+    {"iq4_nl", GGML_TYPE_IQ4_NL},
+};
+
+static inline bool llama_parse_cache_type(const char *name, ggml_type *type)
+{
+    for (const Llama_Cache_Type &t : llama_cache_types) {
+        if (strcmp(t.name, name) == 0) {
+            *type = t.type;
+            return true;
+        }
+    }
+    fprintf(stderr, "ERROR: Unknown KV cache type `%s`, expected one of:", name);
+    for (const Llama_Cache_Type &t : llama_cache_types) fprintf(stderr, " %s", t.name);
+    fputc('\n', stderr);
+    return false;
+}
+
+struct Llama_Adapter {
+    std::string path;
+    float scale;
+    llama_adapter_lora *lora;
+};
+
+struct Llama_Message {
+    llama_chat_message msg;
+    std::int64_t id; // Telegram message id, 0 if unknown
+    size_t pos;      // the message starts at or after this position of the sequence
+    std::int64_t memory_index = -1; // its record in the memory of the chat, -1 if it has none
+};
+
+// Everything the llama generator knows about one conversation: a chat or
+// one of its threads. Every conversation that is in the context owns one
+// sequence of it
+struct Llama_Chat {
+    std::int64_t id;
+    std::int64_t thread = 0;
+    llama_seq_id seq = -1;                   // -1 when the chat is not in the context
+    std::vector<Llama_Message> history;      // without the system messages
+    std::vector<llama_token> kv_tokens;      // tokens decoded into `seq`, in order
+    Llama_Adapter *adapter = nullptr;
+    Memory memory;
+    double t_last_used = 0.0;
+
+    // The running request
+    Gen_Request *req = nullptr;
+    std::vector<llama_token> pending;        // decoded by the next step
+    bool input_added;                        // the input was not observed before
+    size_t prompt_end;                       // where the response starts in the sequence
+    std::string augmented;
+    Loop_Detector loop;
+    std::vector<size_t> offsets;             // size of the response after every token
+    llama_sampler *penalty_smpl = nullptr;   // used after a loop, created when needed
+    bool penalized;
+
+    // The sequence saved in the pager while the chat is not in the context
+    bool paged = false;
+    Kv_Extent page;
+    size_t page_size;
+
+    // Observed messages not decoded yet, in `pending` while there is no request
+    bool prefilling = false;
+    std::vector<Llama_Message> held;         // observed while generating, added after the reply
+};
+
+// Tokens of an observed message decoded along with a step
+struct Llama_Prefill {
+    Llama_Chat *chat;
+    size_t n_tokens;
+};
+
+struct Llama_Chat_Key {
+    std::int64_t chat_id;
+    std::int64_t thread_id;
+
+    bool operator==(const Llama_Chat_Key &other) const
+    {
+        return chat_id == other.chat_id && thread_id == other.thread_id;
+    }
+};
+
+struct Llama_Chat_Key_Hash {
+    size_t operator()(const Llama_Chat_Key &key) const
+    {
+        return std::hash<std::int64_t>()(key.chat_id*LOOP_HASH_BASE + key.thread_id);
+    }
+};
+
+// NOTE: I'm not an OOP guy. These are structures
+struct LlamaGenerator : Generator {
+    size_t n_system_messages = 0;
+    std::int64_t n_ctx = LLAMA_CONTEXT_SIZE;
+    std::int64_t n_seq = LLAMA_SEQUENCES;
+
+    std::unordered_map<Llama_Chat_Key, Llama_Chat *, Llama_Chat_Key_Hash> chats;
+    std::vector<Llama_Chat *> seq_chats; // owner of every sequence
+    std::int64_t n_forks = 0;
+    std::int64_t n_forked_tokens = 0;
+    std::int64_t n_prepared = 0;
+    std::int64_t n_prepared_tokens = 0;
+    std::vector<Llama_Chat *> prefilling;
+    std::vector<Llama_Prefill> riders;
+    std::int64_t n_observed = 0;
+    std::int64_t n_observed_tokens = 0;
+    std::int64_t n_backfilled = 0;
+    std::int64_t n_trimmed = 0;
+    std::int64_t n_prefill_batches = 0;
+    std::int64_t n_prefill_chats = 0;
+    std::vector<Llama_Chat *> filled;
+    std::int64_t n_message_tokens = 0; // added by the chat template around every message
+
+    // LoRA adapters are loaded once and switched per batch
+    std::vector<Llama_Adapter *> adapters;
+    std::unordered_map<std::int64_t, Llama_Adapter *> chat_adapters;
+    Llama_Adapter *active_adapter = nullptr;
+
+    // Retrieval, enabled with `-e`. Only the last messages stay in the
+    // context, older ones come back through the memory when relevant
+    Embedder *embedder = nullptr;
+    const char *memory_path = nullptr;
+    std::int64_t rag_top_k = LLAMA_RAG_TOP_K;
+    std::int64_t rag_window = LLAMA_RAG_WINDOW;
+    float loop_penalty = LOOP_PENALTY;
+
+    // Quantized caches fit more chats into the same memory
+    ggml_type type_k = GGML_TYPE_F16;
+    ggml_type type_v = GGML_TYPE_F16;
+    bool flash_attn = false;
+
+    // Fragmentation of the KV cache, measured when idle after it changed
+    double defrag_threshold = LLAMA_DEFRAG_THRESHOLD;
+    llama_kv_cache_view kv_view;
+    bool kv_dirty = false;
+    int kv_holes = 0;
+    int kv_largest_free = 0;
+    double kv_fragmentation = 0.0;
+    std::int64_t n_defrags = 0;
+    double kv_bytes_per_token = 0.0;
+
+    // Chats pushed out of the context keep their sequences here with `-P`
+    Kv_Pager pager;
+    std::int64_t n_page_outs = 0;
+    std::int64_t n_page_ins = 0;
+    double t_page_ins = 0.0;
+    std::vector<Vec_Hit> hits;
+    std::string recalled;
+
+    std::vector<llama_chat_message> rendered;
+    llama_batch batch;
+    std::vector<Llama_Chat *> active;
+    std::vector<Llama_Chat *> packed;
+
+    virtual bool load(const char *model_path) override
+    {
+        puts("Loading model...");
+
+        llama_model_params model_params = llama_model_default_params();
+        model_params.n_gpu_layers = LLAMA_GPU_LAYER_COUNT;
+
+        model = llama_model_load_from_file(model_path, model_params);
+        if (!model) {
+            fputs("ERROR: Could not load model from file\n", stderr);
+            return false;
+        }
+
+        vocab = llama_model_get_vocab(model);
+
+        return true;
+    }
+
+    // The context depends on the arguments, so it is created after `parse_args`
+    bool init_context()
+    {
+        llama_context_params ctx_params = llama_context_default_params();
+        ctx_params.n_ctx = n_ctx;
+        ctx_params.n_batch = n_ctx;
+        ctx_params.n_seq_max = n_seq;
+        ctx_params.type_k = type_k;
+        ctx_params.type_v = type_v;
+        ctx_params.flash_attn = flash_attn;
+        ctx_params.defrag_thold = -1.0f; // never on the reply path, see `idle`
+
+        ctx = llama_init_from_model(model, ctx_params);
+        if (!ctx) {
+            fputs("ERROR: Could not create context\n", stderr);
+            return false;
+        }
+
+        smpl = llama_sampler_chain_init(llama_sampler_chain_default_params());
+        llama_sampler_chain_add(smpl, llama_sampler_init_min_p(0.05f, 1));
+        llama_sampler_chain_add(smpl, llama_sampler_init_temp(0.8f));
+        llama_sampler_chain_add(smpl, llama_sampler_init_dist(seed));
+
+        formatted = std::vector<char>(llama_n_ctx(ctx));
+        batch = llama_batch_init(n_ctx, 0, 1);
+        kv_view = llama_kv_cache_view_init(ctx, 1);
+        seq_chats.assign(n_seq, nullptr);
+
+        warmup();
+        measure_kv_size();
+        measure_message_tokens();
+        return true;
+    }
+
+    // Tokens of the messages rendered with the chat template, -1 if it fails
+    std::int64_t template_tokens(const llama_chat_message *msgs, size_t n_msgs)
+    {
+        const char *tmpl = llama_model_chat_template(model, nullptr);
+        int len = llama_chat_apply_template(tmpl, msgs, n_msgs, false, formatted.data(), formatted.size());
+        if (len > (int)formatted.size()) {
+            formatted.resize(len);
+            len = llama_chat_apply_template(tmpl, msgs, n_msgs, false, formatted.data(), formatted.size());
+        }
+        if (len < 0) return -1;
+        return -llama_tokenize(vocab, formatted.data(), len, NULL, 0, true, true);
+    }
+
+    // What one more message costs on top of its text: role headers, separators
+    void measure_message_tokens()
+    {
+        const llama_chat_message msgs[2] = {{"user", "x"}, {"assistant", "x"}};
+        std::int64_t one = template_tokens(msgs, 1);
+        std::int64_t two = template_tokens(msgs, 2);
+        if (one < 0 || two < 0) return;
+        std::int64_t text = -llama_tokenize(vocab, "x", 1, NULL, 0, false, false);
+        n_message_tokens = std::max<std::int64_t>(0, two - one - text);
+    }
+
+    // The cache of a sequence grows with every token by what the model
+    // really keeps: the head sizes, sliding windows and latent caches differ
+    // between models, so it is measured instead of derived from the shapes
+    void measure_kv_size()
+    {
+        const std::int64_t n_tokens = std::min<std::int64_t>(LLAMA_MEASURE_TOKENS, n_ctx - 1);
+        if (n_tokens <= 0) return;
+        llama_token token = llama_vocab_bos(vocab) != LLAMA_TOKEN_NULL ? llama_vocab_bos(vocab) : 0;
+        batch.n_tokens = 0;
+        batch_add(batch, token, 0, 0, false);
+        if (llama_decode(ctx, batch) != 0) return;
+        size_t first = llama_state_seq_get_size(ctx, 0);
+
+        batch.n_tokens = 0;
+        for (std::int64_t i = 1; i <= n_tokens; i++) batch_add(batch, token, i, 0, false);
+        if (llama_decode(ctx, batch) == 0) {
+            kv_bytes_per_token = (double)(llama_state_seq_get_size(ctx, 0) - first)/n_tokens;
+        }
+        llama_kv_self_clear(ctx);
+    }
+
+    // Runs the whole model once, so the first reply doesn't pay for reading
+    // the weights in
+    void warmup()
+    {
+        llama_token tokens[2];
+        std::int32_t n_tokens = 0;
+        if (llama_vocab_bos(vocab) != LLAMA_TOKEN_NULL) tokens[n_tokens++] = llama_vocab_bos(vocab);
+        if (llama_vocab_eos(vocab) != LLAMA_TOKEN_NULL) tokens[n_tokens++] = llama_vocab_eos(vocab);
+        if (n_tokens == 0) tokens[n_tokens++] = 0;
+
+        llama_set_warmup(ctx, true);
+        llama_decode(ctx, llama_batch_get_one(tokens, n_tokens));
+        llama_kv_self_clear(ctx);
+        llama_synchronize(ctx);
+        llama_set_warmup(ctx, false);
+    }
+
+    void usage()
+    {
+        fprintf(stderr, "LLAMA ARGS: [OPTIONS] [system-message]\n");
+        fprintf(stderr, "    -c <tokens>   size of the context shared by all chats (default: %d)\n", LLAMA_CONTEXT_SIZE);
+        fprintf(stderr, "    -p <count>    number of chats kept in the context and generated in one batch (default: %d)\n", LLAMA_SEQUENCES);
+        fprintf(stderr, "    -K <type>     type of the K cache: f16, q8_0, q4_0, ... (default: f16)\n");
+        fprintf(stderr, "    -V <type>     type of the V cache, quantized types need -a on (default: f16)\n");
+        fprintf(stderr, "    -a <on|off>   flash attention (default: off)\n");
+        fprintf(stderr, "    -P <dir>      keep the KV cache of the chats pushed out of the context in a file in the directory\n");
+        fprintf(stderr, "    -D <0..1>     defragment the KV cache when idle and fragmented above this (default: %.1f)\n", LLAMA_DEFRAG_THRESHOLD);
+        fprintf(stderr, "    -l <chat-id>=<lora.gguf>[:<scale>]\n");
+        fprintf(stderr, "                  answer in the chat with the LoRA adapter, may be repeated\n");
+        fprintf(stderr, "    -r <penalty>  repetition penalty once a reply loops, 0 ends the reply instead (default: %.1f)\n", LOOP_PENALTY);
+        fprintf(stderr, "    -e <file>     remember the whole chat with the embedding model, keep only the last messages in the context\n");
+        fprintf(stderr, "    -m <path>     keep the memory on disk in <path>.<chat-id>.vec, ... (default: in RAM)\n");
+        fprintf(stderr, "    -k <count>    number of old messages brought back into the prompt (default: %d)\n", LLAMA_RAG_TOP_K);
+        fprintf(stderr, "    -w <count>    number of last messages kept in the context (default: %d)\n", LLAMA_RAG_WINDOW);
+    }
+
+    bool parse_adapter(const char *arg)
+    {
+        const char *eq = strchr(arg, '=');
+        std::int64_t chat_id;
+        if (eq == nullptr || !parse_chat_id(arg, eq - arg, &chat_id)) {
+            fprintf(stderr, "ERROR: Invalid adapter `%s`, expected <chat-id>=<lora.gguf>[:<scale>]\n", arg);
+            return false;
+        }
+
+        std::string path = eq + 1;
+        float scale = 1.0f;
+        size_t colon = path.rfind(':');
+        if (colon != std::string::npos) {
+            char *end;
+            scale = strtof(path.c_str() + colon + 1, &end);
+            if (*end != '\0') {
+                fprintf(stderr, "ERROR: Invalid adapter scale `%s`\n", path.c_str() + colon + 1);
+                return false;
+            }
+            path.resize(colon);
+        }
+
+        Llama_Adapter *adapter = nullptr;
+        for (Llama_Adapter *a : adapters) {
+            if (a->path == path && a->scale == scale) adapter = a;
+        }
+        if (adapter == nullptr) {
+            printf("Loading LoRA adapter %s...\n", path.c_str());
+            llama_adapter_lora *lora = llama_adapter_lora_init(model, path.c_str());
+            if (lora == nullptr) {
+                fprintf(stderr, "ERROR: Could not load LoRA adapter from %s\n", path.c_str());
+                return false;
+            }
+            adapter = new Llama_Adapter{path, scale, lora};
+            adapters.push_back(adapter);
+        }
+
+        chat_adapters[chat_id] = adapter;
+        return true;
+    }
+
+    virtual bool parse_args(int argc, char **argv) override
+    {
+        const char *embedding_model_path = nullptr;
+        while (argc > 0 && argv[0][0] == '-') {
+            if (argc < 2) {
+                fprintf(stderr, "ERROR: No value for option %s\n", argv[0]);
+                return false;
+            }
+
+            if (strcmp(argv[0], "-c") == 0) {
+                if (!str_to_int64(argv[1], strlen(argv[1]), &n_ctx) || n_ctx == 0) {
+                    fprintf(stderr, "ERROR: Invalid context size `%s`\n", argv[1]);
+                    return false;
+                }
+            } else if (strcmp(argv[0], "-p") == 0) {
+                if (!str_to_int64(argv[1], strlen(argv[1]), &n_seq) || n_seq == 0) {
+                    fprintf(stderr, "ERROR: Invalid chat count `%s`\n", argv[1]);
+                    return false;
+                }
+            } else if (strcmp(argv[0], "-K") == 0) {
+                if (!llama_parse_cache_type(argv[1], &type_k)) return false;
+            } else if (strcmp(argv[0], "-V") == 0) {
+                if (!llama_parse_cache_type(argv[1], &type_v)) return false;
+            } else if (strcmp(argv[0], "-a") == 0) {
+                if (strcmp(argv[1], "on") != 0 && strcmp(argv[1], "off") != 0) {
+                    fprintf(stderr, "ERROR: Invalid flash attention `%s`, expected on or off\n", argv[1]);
+                    return false;
+                }
+                flash_attn = strcmp(argv[1], "on") == 0;
+            } else if (strcmp(argv[0], "-P") == 0) {
+                if (!pager.open(argv[1])) return false;
+            } else if (strcmp(argv[0], "-D") == 0) {
+                char *end;
+                defrag_threshold = strtod(argv[1], &end);
+                if (end == argv[1] || *end != '\0' || defrag_threshold < 0.0) {
+                    fprintf(stderr, "ERROR: Invalid defragmentation threshold `%s`\n", argv[1]);
+                    return false;
+                }
+            } else if (strcmp(argv[0], "-l") == 0) {
+                if (!parse_adapter(argv[1])) return false;
+            } else if (strcmp(argv[0], "-r") == 0) {
+                char *end;
+                loop_penalty = strtof(argv[1], &end);
+                if (end == argv[1] || *end != '\0' || loop_penalty < 0.0f) {
+                    fprintf(stderr, "ERROR: Invalid penalty `%s`\n", argv[1]);
+                    return false;
+                }
+            } else if (strcmp(argv[0], "-e") == 0) {
+                embedding_model_path = argv[1];
+            } else if (strcmp(argv[0], "-m") == 0) {
+                memory_path = argv[1];
+            } else if (strcmp(argv[0], "-k") == 0) {
+                if (!str_to_int64(argv[1], strlen(argv[1]), &rag_top_k)) {
+                    fprintf(stderr, "ERROR: Invalid top-k `%s`\n", argv[1]);
+                    return false;
+                }
+            } else if (strcmp(argv[0], "-w") == 0) {
+                if (!str_to_int64(argv[1], strlen(argv[1]), &rag_window) || rag_window == 0) {
+                    fprintf(stderr, "ERROR: Invalid window `%s`\n", argv[1]);
+                    return false;
+                }
+            } else {
+                usage();
+                fprintf(stderr, "ERROR: Unknown option %s\n", argv[0]);
+                return false;
+            }
+            argc -= 2; argv += 2;
+        }
+
+        if (argc > 1) {
+            usage();
+            return false;
+        }
+
+        // llama.cpp only reads a quantized V cache inside flash attention
+        if (ggml_is_quantized(type_v) && !flash_attn) {
+            fputs("ERROR: Quantized V cache needs flash attention (-a on)\n", stderr);
+            return false;
+        }
+
+        if (embedding_model_path != nullptr) {
+            embedder = new Embedder{};
+            if (!embedder->load(embedding_model_path)) return false;
+        }
+
+        if (argc == 1) {
+            printf("Pushing system message \"%s\" to model...\n", argv[0]);
+
+            messages.push_back({"system", strdup(argv[0])});
+            n_system_messages = messages.size();
+        }
+
+        return init_context();
+    }
+
+    virtual ~LlamaGenerator() override
+    {
+        for (auto &it : chats) delete_chat(it.second);
+        for (size_t i = 0; i < n_system_messages; i++) free((void *)messages[i].content);
+        pager.close();
+        if (ctx != nullptr) {
+            llama_kv_cache_view_free(&kv_view);
+            llama_batch_free(batch);
+            llama_sampler_free(smpl);
+            llama_free(ctx);
+        }
+        for (Llama_Adapter *adapter : adapters) {
+            llama_adapter_lora_free(adapter->lora);
+            delete adapter;
+        }
+        if (embedder != nullptr) {
+            embedder->unload();
+            delete embedder;
+        }
+        if (model != nullptr) llama_model_free(model);
+    }
+
+    bool open_memory(Llama_Chat *chat)
+    {
+        if (embedder == nullptr) return true;
+        std::string path = memory_path != nullptr ? std::string(memory_path) + "." + std::to_string(chat->id) : "";
+        if (chat->thread != 0) path += "." + std::to_string(chat->thread);
+        return chat->memory.open(embedder, memory_path != nullptr ? path.c_str() : nullptr);
+    }
+
+    Llama_Chat *get_chat(std::int64_t chat_id, std::int64_t thread_id)
+    {
+        auto it = chats.find({chat_id, thread_id});
+        if (it != chats.end()) return it->second;
+
+        Llama_Chat *chat = new Llama_Chat{};
+        chat->id = chat_id;
+        chat->thread = thread_id;
+        auto adapter = chat_adapters.find(chat_id);
+        if (adapter != chat_adapters.end()) chat->adapter = adapter->second;
+        if (!open_memory(chat)) {
+            delete_chat(chat);
+            return nullptr;
+        }
+        chats[{chat_id, thread_id}] = chat;
+        return chat;
+    }
+
+    void delete_chat(Llama_Chat *chat)
+    {
+        for (const Llama_Message &m : chat->history) free((void *)m.msg.content);
+        for (const Llama_Message &m : chat->held) free((void *)m.msg.content);
+        chat->memory.store.close();
+        if (chat->penalty_smpl != nullptr) llama_sampler_free(chat->penalty_smpl);
+        delete chat;
+    }
+
+    // Takes a chat of the generator this one replaces. Only the history and
+    // the memory survive, the new context is filled by the next `begin`. The
+    // messages of the chat that got here first follow its history
+    bool adopt_chat(Llama_Chat *chat)
+    {
+        std::vector<Llama_Message> later;
+        auto it = chats.find({chat->id, chat->thread});
+        if (it != chats.end()) {
+            Llama_Chat *young = it->second;
+            if (young->req != nullptr) return false;
+            if (young->seq >= 0) evict(young);
+            drop_page(young);
+            later.swap(young->history);
+            delete_chat(young);
+            chats.erase(it);
+        }
+
+        chat->seq = -1;
+        chat->kv_tokens.clear();
+        auto adapter = chat_adapters.find(chat->id);
+        chat->adapter = adapter != chat_adapters.end() ? adapter->second : nullptr;
+
+        Embedder *old = chat->memory.embedder;
+        if (old != nullptr && embedder != nullptr && old->dim == embedder->dim) {
+            chat->memory.embedder = embedder;
+        } else if (old != nullptr || embedder != nullptr) {
+            chat->memory.store.close();
+            chat->memory = Memory{};
+            if (!open_memory(chat)) {
+                for (const Llama_Message &m : later) free((void *)m.msg.content);
+                return false;
+            }
+        }
+
+        chats[{chat->id, chat->thread}] = chat;
+        for (const Llama_Message &m : later) {
+            if (find_message(chat, m.id) != nullptr) {
+                free((void *)m.msg.content);
+                continue;
+            }
+            add_message(chat, m);
+        }
+        return true;
+    }
+
+    virtual bool has_chat(std::int64_t chat_id, std::int64_t thread_id) override
+    {
+        return chats.count({chat_id, thread_id}) != 0;
+    }
+
+    virtual void move_idle_chats(Generator *to) override
+    {
+        LlamaGenerator *next = dynamic_cast<LlamaGenerator *>(to);
+        for (auto it = chats.begin(); it != chats.end();) {
+            Llama_Chat *chat = it->second;
+            if (chat->req != nullptr) {
+                ++it;
+                continue;
+            }
+
+            if (chat->seq >= 0) evict(chat);
+            drop_page(chat);
+            // Pending messages stay pending, `adopt_chat` keeps them when it
+            // keeps the memory
+            if (next == nullptr || !next->adopt_chat(chat)) delete_chat(chat);
+            it = chats.erase(it);
+        }
+    }
+
+    void evict(Llama_Chat *chat)
+    {
+        stop_prefill(chat);
+        kv_dirty = true;
+        llama_kv_self_seq_rm(ctx, chat->seq, -1, -1);
+        seq_chats[chat->seq] = nullptr;
+        chat->seq = -1;
+        if (!chat->paged) chat->kv_tokens.clear();
+    }
+
+    // Evicts the chat, but saves its sequence first so it comes back without a prefill
+    void page_out(Llama_Chat *chat)
+    {
+        if (pager.is_open() && !chat->kv_tokens.empty()) {
+            size_t size = llama_state_seq_get_size(ctx, chat->seq);
+            if (pager.alloc(size, &chat->page)) {
+                if (llama_state_seq_get_data(ctx, pager.data(chat->page), size, chat->seq) == size) {
+                    chat->paged = true;
+                    chat->page_size = size;
+                    n_page_outs += 1;
+                } else {
+                    pager.release(chat->page);
+                }
+            }
+        }
+        evict(chat);
+    }
+
+    void page_in(Llama_Chat *chat)
+    {
+        double t = now_seconds();
+        if (llama_state_seq_set_data(ctx, pager.data(chat->page), chat->page_size, chat->seq) > 0) {
+            n_page_ins += 1;
+            t_page_ins += now_seconds() - t;
+        } else {
+            llama_kv_self_seq_rm(ctx, chat->seq, -1, -1);
+            chat->kv_tokens.clear();
+        }
+        pager.release(chat->page);
+        chat->paged = false;
+        kv_dirty = true;
+    }
+
+    void drop_page(Llama_Chat *chat)
+    {
+        if (!chat->paged) return;
+        pager.release(chat->page);
+        chat->paged = false;
+        chat->kv_tokens.clear();
+    }
+
+    // The least recently used chat that is in the context but not generating
+    Llama_Chat *idle_resident_chat(Llama_Chat *except)
+    {
+        Llama_Chat *lru = nullptr;
+        for (Llama_Chat *c : seq_chats) {
+            if (c == nullptr || c == except || c->req != nullptr) continue;
+            if (lru == nullptr || c->t_last_used < lru->t_last_used) lru = c;
+        }
+        return lru;
+    }
+
+    bool acquire_seq(Llama_Chat *chat)
+    {
+        if (chat->seq >= 0) return true;
+
+        for (size_t s = 0; s < seq_chats.size(); s++) {
+            if (seq_chats[s] == nullptr) {
+                chat->seq = s;
+                seq_chats[s] = chat;
+                if (chat->paged) page_in(chat);
+                return true;
+            }
+        }
+
+        Llama_Chat *lru = idle_resident_chat(nullptr);
+        if (lru == nullptr) return false;
+
+        llama_seq_id seq = lru->seq;
+        page_out(lru);
+        chat->seq = seq;
+        seq_chats[seq] = chat;
+        if (chat->paged) page_in(chat);
+        return true;
+    }
+
+    // A thread starts as a copy of the main conversation up to the message it
+    // replies to and our replies to that message, which have no id. The
+    // sequence is shared, not copied: the cells just get one more owner, and
+    // the next `begin` drops what the thread does not share
+    void fork(Llama_Chat *chat, Llama_Chat *trunk)
+    {
+        size_t n_shared = 0;
+        while (n_shared < trunk->history.size() && trunk->history[n_shared].id != chat->thread) n_shared++;
+        if (n_shared == trunk->history.size()) n_shared = 0;  // a topic of its own
+        else n_shared += 1;
+        while (n_shared > 0 && n_shared < trunk->history.size() &&
+               strcmp(trunk->history[n_shared].msg.role, "assistant") == 0) {
+            n_shared++;
+        }
+        for (size_t i = 0; i < n_shared; i++) {
+            Llama_Message m = trunk->history[i];
+            m.msg.content = strdup(m.msg.content);
+            m.memory_index = -1;  // the memory of the thread has its own messages only
+            chat->history.push_back(m);
+        }
+
+        if (chat->seq < 0 || trunk->seq < 0 || trunk->kv_tokens.empty()) return;
+        llama_kv_self_seq_rm(ctx, chat->seq, -1, -1);
+        llama_kv_self_seq_cp(ctx, trunk->seq, chat->seq, -1, -1);
+        chat->kv_tokens = trunk->kv_tokens;
+        kv_dirty = true;
+        n_forks += 1;
+    }
+
+    // Finds the conversation or starts it, a new thread is forked from the
+    // main conversation. The conversation may be out of the context
+    Llama_Chat *open_chat(std::int64_t chat_id, std::int64_t thread_id, bool *forked)
+    {
+        *forked = false;
+        auto it = chats.find({chat_id, thread_id});
+        if (it != chats.end()) return it->second;
+
+        Llama_Chat *chat = get_chat(chat_id, thread_id);
+        if (chat == nullptr || thread_id == 0) return chat;
+        auto trunk = chats.find({chat_id, 0});
+        if (trunk == chats.end()) return chat;
+
+        // Keep the main conversation in the context to fork from it
+        trunk->second->t_last_used = now_seconds();
+        acquire_seq(chat);
+        fork(chat, trunk->second);
+        *forked = true;
+        return chat;
+    }
+
+    void use_adapter(Llama_Adapter *adapter)
+    {
+        if (adapter == active_adapter) return;
+        if (active_adapter != nullptr) llama_rm_adapter_lora(ctx, active_adapter->lora);
+        if (adapter != nullptr) llama_set_adapter_lora(ctx, adapter->lora, adapter->scale);
+        active_adapter = adapter;
+    }
+
+    virtual int batch_group(std::int64_t chat_id) override
+    {
+        auto it = chat_adapters.find(chat_id);
+        if (it == chat_adapters.end()) return 0;
+        return 1 + (std::find(adapters.begin(), adapters.end(), it->second) - adapters.begin());
+    }
+
+    virtual size_t max_batch() override
+    {
+        return n_seq;
+    }
+
+    void measure_kv()
+    {
+        llama_kv_cache_view_update(ctx, &kv_view);
+
+        int n_free = 0, run = 0;
+        kv_holes = 0;
+        kv_largest_free = 0;
+        for (int i = 0; i < kv_view.n_cells; i++) {
+            if (kv_view.cells[i].pos < 0) {
+                n_free += 1;
+                run += 1;
+                kv_largest_free = std::max(kv_largest_free, run);
+            } else {
+                if (run > 0) kv_holes += 1;
+                run = 0;
+            }
+        }
+        kv_fragmentation = n_free > 0 ? 1.0 - (double)kv_largest_free/n_free : 0.0;
+    }
+
+    virtual bool idle() override
+    {
+        // One batch per call, like the retraining below
+        if (!prefilling.empty()) {
+            n_observed_tokens += prefill_batch();
+            return !prefilling.empty();
+        }
+
+        // One chat per call, the messages observed or backfilled since its
+        // last reply would otherwise be embedded before the next one starts
+        for (auto &it : chats) {
+            Llama_Chat *chat = it.second;
+            if (chat->req != nullptr || chat->memory.pending.empty()) continue;
+            if (chat->memory.embed_pending()) return true;
+            fprintf(stderr, "ERROR: Could not embed the messages of chat %ld\n", (long)chat->id);
+            break;
+        }
+
+        // One memory per call, the k-means of a big one takes a while
+        for (auto &it : chats) {
+            Vec_Store &store = it.second->memory.store;
+            if (it.second->req != nullptr || !store.train_due()) continue;
+            if (!store.train()) fprintf(stderr, "ERROR: Could not retrain the memory of chat %ld\n", (long)it.second->id);
+            break;
+        }
+
+        if (!kv_dirty) return false;
+        kv_dirty = false;
+
+        measure_kv();
+        if (kv_fragmentation > defrag_threshold) {
+            llama_kv_self_defrag(ctx);
+            llama_kv_self_update(ctx);
+            n_defrags += 1;
+            measure_kv();
+        }
+        return false;
+    }
+
+    virtual void print_stats(FILE *f) override
+    {
+        fprintf(f, "KV cache: %d/%d cells used, %d holes, largest free run %d, fragmentation %.2f, %ld defragmentations\n",
+                kv_view.used_cells, kv_view.n_cells, kv_holes, kv_largest_free, kv_fragmentation, (long)n_defrags);
+        if (pager.is_open()) {
+            fprintf(f, "KV pager: %ld sequences saved, %ld restored in %.2fms on average, %.1fMB in use\n",
+                    (long)n_page_outs, (long)n_page_ins, n_page_ins > 0 ? t_page_ins/n_page_ins*1000.0 : 0.0,
+                    pager.end/1048576.0);
+        }
+        if (n_observed > 0 || n_backfilled > 0) {
+            fprintf(f, "Observed: %ld messages and %ld from before the start, %ld tokens decoded ahead in %ld batches of %.1f chats\n",
+                    (long)n_observed, (long)n_backfilled, (long)n_observed_tokens, (long)n_prefill_batches,
+                    n_prefill_batches > 0 ? (double)n_prefill_chats/n_prefill_batches : 0.0);
+        }
+        if (n_prepared > 0) {
+            fprintf(f, "Typing: %ld chats prepared, %ld tokens decoded ahead\n", (long)n_prepared, (long)n_prepared_tokens);
+        }
+        if (n_forks > 0) {
+            fprintf(f, "Threads: %ld forked, %ld tokens shared instead of decoded\n", (long)n_forks, (long)n_forked_tokens);
+        }
+        if (n_trimmed > 0) {
+            fprintf(f, "History: %ld old messages dropped to fit the context\n", (long)n_trimmed);
+        }
+    }
+
+    virtual double bytes_per_token() override
+    {
+        return kv_bytes_per_token;
+    }
+
+    // Old messages similar to the input, in chronological order. The input
+    // must be the last message added to the memory. Also slides the window
+    // of live messages
+    bool recall(Llama_Chat *chat, const std::string &input, std::string &res)
+    {
+        res.clear();
+        if (!chat->memory.embed_pending()) return false;
+
+        // Sliding by a whole window at once keeps the KV prefix stable between slides
+        std::vector<Llama_Message> &history = chat->history;
+        if ((std::int64_t)history.size() > 2*rag_window) {
+            size_t n_drop = history.size() - rag_window;
+            for (size_t i = 0; i < n_drop; i++) free((void *)history[i].msg.content);
+            history.erase(history.begin(), history.begin() + n_drop);
+        }
+
+        // Only the records older than the live messages, the input was
+        // embedded last. Backfilled messages are remembered after the live
+        // ones they precede
+        size_t n_old = chat->memory.count();
+        for (const Llama_Message &m : history) {
+            if (m.memory_index >= 0) n_old = std::min(n_old, (size_t)m.memory_index);
+        }
+        chat->memory.store.search(chat->memory.vector.data(), n_old, rag_top_k, hits);
+        if (hits.empty()) return true;
+
+        std::sort(hits.begin(), hits.end(), [](const Vec_Hit &a, const Vec_Hit &b) { return a.index < b.index; });
+        res = "Earlier in this chat:\n";
+        for (const Vec_Hit &hit : hits) {
+            std::uint32_t role;
+            if (!chat->memory.store.read_text(hit.index, recalled, &role)) return false;
+            res += role == VEC_ROLE_USER ? "user: " : "assistant: ";
+            res += recalled;
+            res += "\n";
+        }
+        res += "\n";
+        res += input;
+        return true;
+    }
+
+    // The system messages and the history, followed by the prompt of the reply
+    // when `add_ass`. Drops the oldest messages when it doesn't fit, the last
+    // one always stays
+    bool tokenize_chat(Llama_Chat *chat, bool add_ass, std::vector<llama_token> &tokens)
+    {
+        if (!render_chat(chat, add_ass, tokens)) return false;
+        // All the sequences share the cache, every chat gets its part of it
+        const std::int64_t n_seq_ctx = n_ctx/n_seq;
+        if ((std::int64_t)tokens.size() <= LLAMA_HISTORY_MAX*n_seq_ctx) return true;
+
+        // Trimming well below the limit keeps the KV prefix stable for a while
+        std::vector<Llama_Message> &history = chat->history;
+        while ((std::int64_t)tokens.size() > LLAMA_HISTORY_TRIM*n_seq_ctx && history.size() > 1) {
+            std::int64_t excess = tokens.size() - (std::int64_t)(LLAMA_HISTORY_TRIM*n_seq_ctx);
+            size_t n_drop = 0;
+            while (excess > 0 && n_drop + 1 < history.size()) {
+                const char *content = history[n_drop].msg.content;
+                excess += llama_tokenize(vocab, content, strlen(content), NULL, 0, false, false);
+                n_drop++;
+            }
+            for (size_t i = 0; i < n_drop; i++) free((void *)history[i].msg.content);
+            history.erase(history.begin(), history.begin() + n_drop);
+            n_trimmed += n_drop;
+            if (!render_chat(chat, add_ass, tokens)) return false;
+        }
+        return true;
+    }
+
+    bool render_chat(Llama_Chat *chat, bool add_ass, std::vector<llama_token> &tokens)
+    {
+        const char *tmpl = llama_model_chat_template(model, nullptr);
+
+        rendered.assign(messages.begin(), messages.begin() + n_system_messages);
+        for (const Llama_Message &m : chat->history) rendered.push_back(m.msg);
+        if (add_ass && !chat->augmented.empty()) rendered.back().content = chat->augmented.c_str();
+
+        int new_len = llama_chat_apply_template(tmpl, rendered.data(), rendered.size(), add_ass, formatted.data(), formatted.size());
+        if (new_len > (int)formatted.size()) {
+            formatted.resize(new_len);
+            new_len = llama_chat_apply_template(tmpl, rendered.data(), rendered.size(), add_ass, formatted.data(), formatted.size());
+        }
+        if (new_len < 0) {
+            fputs("ERROR: Could not apply chat template\n", stderr);
+            return false;
+        }
+
+        const int n_tokens = -llama_tokenize(vocab, formatted.data(), new_len, NULL, 0, true, true);
+        tokens.resize(n_tokens);
+        if (llama_tokenize(vocab, formatted.data(), new_len, tokens.data(), tokens.size(), true, true) < 0) {
+            fputs("ERROR: Could not tokenize the prompt\n", stderr);
+            return false;
+        }
+        return true;
+    }
+
+    // Reuses the part of the sequence that is still valid (up to `max_keep`
+    // tokens) and drops the rest. Returns the number of tokens kept
+    size_t keep_prefix(Llama_Chat *chat, const std::vector<llama_token> &tokens, size_t max_keep)
+    {
+        std::vector<llama_token> &kv_tokens = chat->kv_tokens;
+        size_t n_keep = 0;
+        while (n_keep < kv_tokens.size() && n_keep < max_keep &&
+               kv_tokens[n_keep] == tokens[n_keep]) n_keep++;
+        kv_dirty = true;
+        if (!llama_kv_self_seq_rm(ctx, chat->seq, n_keep, -1)) {
+            llama_kv_self_seq_rm(ctx, chat->seq, -1, -1);
+            n_keep = 0;
+        }
+        kv_tokens.resize(n_keep);
+
+        // Everything past `n_keep` is decoded again and may have moved
+        for (Llama_Message &m : chat->history) m.pos = std::min(m.pos, n_keep);
+        return n_keep;
+    }
+
+    // Queues the part of the rendered history of a resident conversation that
+    // is not decoded yet. It is decoded along with the next steps or when idle
+    void queue_prefill(Llama_Chat *chat)
+    {
+        std::vector<llama_token> &tokens = chat->pending;
+        if (!tokenize_chat(chat, false, tokens) || (std::int64_t)tokens.size() > n_ctx) {
+            stop_prefill(chat);
+            return;
+        }
+        size_t n_keep = keep_prefix(chat, tokens, tokens.size());
+        tokens.erase(tokens.begin(), tokens.begin() + n_keep);
+        if (tokens.empty()) {
+            stop_prefill(chat);
+        } else if (!chat->prefilling) {
+            chat->prefilling = true;
+            prefilling.push_back(chat);
+        }
+    }
+
+    void stop_prefill(Llama_Chat *chat)
+    {
+        if (!chat->prefilling) return;
+        chat->prefilling = false;
+        chat->pending.clear();
+        prefilling.erase(std::find(prefilling.begin(), prefilling.end(), chat));
+    }
+
+    // Decodes the queued tokens of the conversation at once
+    bool prefill(Llama_Chat *chat)
+    {
+        use_adapter(chat->adapter);
+        batch.n_tokens = 0;
+        for (size_t i = 0; i < chat->pending.size(); i++) {
+            batch_add(batch, chat->pending[i], chat->kv_tokens.size() + i, chat->seq, false);
+        }
+        kv_dirty = true;
+        int err;
+        while ((err = llama_decode(ctx, batch)) == 1) {
+            // No room in the KV cache: make some by paging out another chat
+            // that is not generating
+            Llama_Chat *lru = idle_resident_chat(chat);
+            if (lru == nullptr) break;
+            page_out(lru);
+        }
+        bool ok = err == 0;
+        if (ok) {
+            chat->kv_tokens.insert(chat->kv_tokens.end(), chat->pending.begin(), chat->pending.end());
+        } else {
+            llama_kv_self_seq_rm(ctx, chat->seq, chat->kv_tokens.size(), -1);
+        }
+        stop_prefill(chat);
+        return ok;
+    }
+
+    // Decodes the queued tokens of as many conversations as fit in a batch,
+    // all with the adapter of the first one. Returns the number of tokens
+    std::int64_t prefill_batch()
+    {
+        Llama_Adapter *adapter = prefilling.back()->adapter;
+        const size_t n_batch = llama_n_batch(ctx);
+        batch.n_tokens = 0;
+        filled.clear();
+        for (size_t i = prefilling.size(); i-- > 0;) {
+            Llama_Chat *chat = prefilling[i];
+            if (chat->adapter != adapter) continue;
+            if (batch.n_tokens > 0 && batch.n_tokens + chat->pending.size() > n_batch) continue;
+            for (size_t j = 0; j < chat->pending.size(); j++) {
+                batch_add(batch, chat->pending[j], chat->kv_tokens.size() + j, chat->seq, false);
+            }
+            filled.push_back(chat);
+        }
+
+        std::int64_t n_tokens = 0;
+        if (filled.size() == 1) {
+            n_tokens = filled[0]->pending.size();
+            n_prefill_batches += 1;
+            n_prefill_chats += 1;
+            return prefill(filled[0]) ? n_tokens : 0;
+        }
+
+        // Too little room in the cache for all of them, one at a time then
+        use_adapter(adapter);
+        kv_dirty = true;
+        if (llama_decode(ctx, batch) != 0) {
+            for (Llama_Chat *chat : filled) llama_kv_self_seq_rm(ctx, chat->seq, chat->kv_tokens.size(), -1);
+            for (Llama_Chat *chat : filled) {
+                // Paged out to make room for one before it
+                if (!chat->prefilling) continue;
+                size_t n = chat->pending.size();
+                if (prefill(chat)) n_tokens += n;
+                n_prefill_batches += 1;
+                n_prefill_chats += 1;
+            }
+            return n_tokens;
+        }
+
+        for (Llama_Chat *chat : filled) {
+            chat->kv_tokens.insert(chat->kv_tokens.end(), chat->pending.begin(), chat->pending.end());
+            n_tokens += chat->pending.size();
+            stop_prefill(chat);
+        }
+        n_prefill_batches += 1;
+        n_prefill_chats += filled.size();
+        return n_tokens;
+    }
+
+    void add_message(Llama_Chat *chat, Llama_Message m)
+    {
+        m.pos = chat->kv_tokens.size();
+        chat->history.push_back(m);
+        remember(chat, chat->history.back());
+    }
+
+    // Adds the message of the history to the memory
+    void remember(Llama_Chat *chat, Llama_Message &m)
+    {
+        if (embedder == nullptr) return;
+        m.memory_index = chat->memory.count();
+        chat->memory.add(strcmp(m.msg.role, "assistant") == 0 ? VEC_ROLE_ASSISTANT : VEC_ROLE_USER, m.msg.content);
+    }
+
+    // Messages observed while the reply was generated follow it
+    void add_held(Llama_Chat *chat)
+    {
+        if (chat->held.empty()) return;
+        for (const Llama_Message &m : chat->held) add_message(chat, m);
+        chat->held.clear();
+        if (chat->seq >= 0) queue_prefill(chat);
+    }
+
+    // Brings the conversation into the context and decodes its history, so
+    // that the next `begin` only decodes the new message
+    virtual void prepare(std::int64_t chat_id, std::int64_t thread_id) override
+    {
+        bool forked;
+        Llama_Chat *chat = open_chat(chat_id, thread_id, &forked);
+        if (chat == nullptr || chat->req != nullptr) return;
+        chat->t_last_used = now_seconds();
+        if (!acquire_seq(chat)) return;
+        if (embedder != nullptr && !chat->memory.embed_pending()) return;
+
+        n_prepared += 1;
+        queue_prefill(chat);
+        if (!chat->prefilling) return;
+        size_t n_tokens = chat->pending.size();
+        if (prefill(chat)) n_prepared_tokens += n_tokens;
+    }
+
+    virtual void observe(std::int64_t chat_id, std::int64_t thread_id, std::int64_t message_id,
+                         bool own, const std::string &text) override
+    {
+        bool forked;
+        Llama_Chat *chat = open_chat(chat_id, thread_id, &forked);
+        if (chat == nullptr) return;
+        n_observed += 1;
+        Llama_Message m = {{own ? "assistant" : "user", strdup(text.c_str())}, message_id, 0};
+        if (chat->req != nullptr) {
+            chat->held.push_back(m);
+            return;
+        }
+        add_message(chat, m);
+
+        chat->t_last_used = now_seconds();
+        if (!acquire_seq(chat)) return;
+        queue_prefill(chat);
+    }
+
+    // Tokenized and queued once for all the messages, decoded with other
+    // conversations in `idle`
+    virtual void backfill(std::int64_t chat_id, std::int64_t thread_id, const std::vector<Gen_Message> &messages) override
+    {
+        bool forked;
+        Llama_Chat *chat = open_chat(chat_id, thread_id, &forked);
+        if (chat == nullptr || chat->req != nullptr) return;
+
+        // Only the newest messages that fit into the share of one sequence
+        // next to the templated prompt the chat already has, `tokenize_chat`
+        // would drop the others
+        std::vector<llama_token> tokens;
+        if (!render_chat(chat, false, tokens)) return;
+        std::int64_t budget = LLAMA_HISTORY_TRIM*(n_ctx/n_seq) - (std::int64_t)tokens.size();
+        size_t first = messages.size();
+        while (first > 0) {
+            const std::string &text = messages[first - 1].text;
+            budget += llama_tokenize(vocab, text.c_str(), text.size(), NULL, 0, false, false);
+            budget -= n_message_tokens;
+            if (budget < 0) break;
+            first--;
+        }
+
+        // The history goes before the live messages the chat already has,
+        // the sequence is decoded again from there
+        std::int64_t newest = messages.empty() ? 0 : messages.back().message_id;
+        size_t at = 0;
+        while (at < chat->history.size() && chat->history[at].id <= newest) at++;
+        if (at < chat->history.size()) truncate(chat, chat->history[at].pos);
+
+        for (size_t i = first; i < messages.size(); i++) {
+            const Gen_Message &message = messages[i];
+            if (find_message(chat, message.message_id) != nullptr) continue;
+            Llama_Message m = {{message.own ? "assistant" : "user", strdup(message.text.c_str())}, message.message_id,
+                               chat->kv_tokens.size()};
+            chat->history.insert(chat->history.begin() + at, m);
+            remember(chat, chat->history[at]);
+            at += 1;
+            n_backfilled += 1;
+        }
+
+        chat->t_last_used = now_seconds();
+        if (!acquire_seq(chat)) return;
+        queue_prefill(chat);
+    }
+
+    virtual bool begin(Gen_Request &req) override
+    {
+        req.t_start = now_seconds();
+        req.status = GEN_ERROR;
+        req.response.clear();
+        req.stats = {};
+
+        bool forked;
+        Llama_Chat *chat = open_chat(req.chat_id, req.thread_id, &forked);
+        if (chat == nullptr) return false;
+        if (chat->req != nullptr) {
+            fprintf(stderr, "ERROR: Chat %ld is already generating\n", (long)chat->id);
+            return false;
+        }
+        if (!acquire_seq(chat)) {
+            fputs("ERROR: All sequences of the context are generating\n", stderr);
+            return false;
+        }
+        chat->t_last_used = req.t_start;
+        stop_prefill(chat);
+
+        // An observed input is already in the history, and maybe in the context
+        chat->input_added = find_message(chat, req.message_id) == nullptr;
+        if (chat->input_added) {
+            chat->history.push_back({{"user", strdup(req.input.c_str())}, req.message_id, 0});
+            remember(chat, chat->history.back());
+        }
+
+        // The recalled messages are only shown this time, the history keeps
+        // the plain messages. The recall is for the last message
+        chat->augmented.clear();
+        if (embedder != nullptr && !recall(chat, chat->history.back().msg.content, chat->augmented)) return fail(chat, req);
+
+        std::vector<llama_token> &tokens = chat->pending;
+        if (!tokenize_chat(chat, true, tokens)) return fail(chat, req);
+
+        // At least one token is decoded to get the logits
+        size_t n_keep = keep_prefix(chat, tokens, tokens.size() - 1);
+        if (forked) n_forked_tokens += n_keep;
+        if (chat->input_added) chat->history.back().pos = n_keep;
+        chat->prompt_end = tokens.size();
+
+        tokens.erase(tokens.begin(), tokens.begin() + n_keep);
+        req.stats.n_prompt_tokens = tokens.size();
+
+        chat->loop.reset();
+        chat->offsets.clear();
+        chat->penalized = false;
+        chat->req = &req;
+        req.status = GEN_RUNNING;
+        return true;
+    }
+
+    virtual bool step(Gen_Request &req) override
+    {
+        Gen_Request *reqs[] = {&req};
+        step_batch(reqs, 1);
+        return req.status == GEN_RUNNING;
+    }
+
+    // The prompt stays in the sequence, so the `begin` of the same input
+    // that usually follows only decodes its last token
+    virtual bool score_reply(std::int64_t chat_id, std::int64_t thread_id, const std::string &input,
+                             const std::string &reply, double *log_prob, std::int64_t *n_tokens) override
+    {
+        bool forked;
+        Llama_Chat *chat = open_chat(chat_id, thread_id, &forked);
+        if (chat == nullptr || chat->req != nullptr || !acquire_seq(chat)) return false;
+        chat->t_last_used = now_seconds();
+        stop_prefill(chat);
+        chat->augmented.clear();
+
+        chat->history.push_back({{"user", strdup(input.c_str())}, 0, 0});
+        std::vector<llama_token> &tokens = chat->pending;
+        bool ok = tokenize_chat(chat, true, tokens);
+        const size_t prompt_size = tokens.size();
+        const int n_reply = ok ? -llama_tokenize(vocab, reply.c_str(), reply.size(), NULL, 0, false, false) : 0;
+        ok = ok && n_reply > 0 && (std::int64_t)(prompt_size + n_reply) <= n_ctx;
+        if (ok) {
+            tokens.resize(prompt_size + n_reply);
+            ok = llama_tokenize(vocab, reply.c_str(), reply.size(), tokens.data() + prompt_size, n_reply, false, false) >= 0;
+        }
+
+        if (ok) {
+            // The logits of the last prompt token on predict the reply, its
+            // last token is not decoded
+            size_t n_keep = keep_prefix(chat, tokens, prompt_size - 1);
+            use_adapter(chat->adapter);
+            batch.n_tokens = 0;
+            for (size_t i = n_keep; i + 1 < tokens.size(); i++) {
+                batch_add(batch, tokens[i], i, chat->seq, i + 1 >= prompt_size);
+            }
+            ok = llama_decode(ctx, batch) == 0;
+            if (ok) {
+                *log_prob = 0.0;
+                for (size_t i = prompt_size; i < tokens.size(); i++) *log_prob += token_log_prob(i - 1 - n_keep, tokens[i]);
+                *n_tokens = n_reply;
+                chat->kv_tokens.assign(tokens.begin(), tokens.begin() + prompt_size);
+            }
+            llama_kv_self_seq_rm(ctx, chat->seq, chat->kv_tokens.size(), -1);
+        }
+
+        free((void *)chat->history.back().msg.content);
+        chat->history.pop_back();
+        tokens.clear();
+        return ok;
+    }
+
+    static void batch_add(llama_batch &batch, llama_token token, llama_pos pos, llama_seq_id seq, bool logits)
+    {
+        batch.token[batch.n_tokens] = token;
+        batch.pos[batch.n_tokens] = pos;
+        batch.n_seq_id[batch.n_tokens] = 1;
+        batch.seq_id[batch.n_tokens][0] = seq;
+        batch.logits[batch.n_tokens] = logits;
+        batch.n_tokens += 1;
+    }
+
+    // The rest of the reply is sampled with a repetition penalty over the recent tokens
+    void penalize(Llama_Chat *chat)
+    {
+        if (chat->penalty_smpl == nullptr) {
+            chat->penalty_smpl = llama_sampler_chain_init(llama_sampler_chain_default_params());
+            llama_sampler_chain_add(chat->penalty_smpl, llama_sampler_init_penalties(LOOP_PENALTY_LAST_N, loop_penalty, 0.0f, 0.0f));
+            llama_sampler_chain_add(chat->penalty_smpl, llama_sampler_init_min_p(0.05f, 1));
+            llama_sampler_chain_add(chat->penalty_smpl, llama_sampler_init_temp(0.8f));
+            llama_sampler_chain_add(chat->penalty_smpl, llama_sampler_init_dist(seed));
+        }
+        llama_sampler_reset(chat->penalty_smpl);
+        const std::vector<std::uint32_t> &tokens = chat->loop.tokens;
+        size_t n = std::min(tokens.size(), (size_t)LOOP_PENALTY_LAST_N);
+        for (size_t i = tokens.size() - n; i < tokens.size(); i++) llama_sampler_accept(chat->penalty_smpl, tokens[i]);
+        chat->penalized = true;
+    }
+
+    // Log-probability of the token under the raw distribution of the model
+    double token_log_prob(int i, llama_token token)
+    {
+        const float *logits = llama_get_logits_ith(ctx, i);
+        const int n_vocab = llama_vocab_n_tokens(vocab);
+        float max = logits[0];
+        for (int j = 1; j < n_vocab; j++) max = std::max(max, logits[j]);
+        double sum = 0.0;
+        for (int j = 0; j < n_vocab; j++) sum += exp(logits[j] - max);
+        return logits[token] - max - log(sum);
+    }
+
+    // Decodes the pending tokens of every chat in `packed` in one batch and samples the next tokens
+    void decode_packed()
+    {
+        if (packed.empty()) return;
+
+        batch.n_tokens = 0;
+        std::vector<int> logits_index(packed.size());
+        std::vector<int> starts(packed.size());
+        for (size_t i = 0; i < packed.size(); i++) {
+            Llama_Chat *chat = packed[i];
+            starts[i] = batch.n_tokens;
+            for (size_t j = 0; j < chat->pending.size(); j++) {
+                batch_add(batch, chat->pending[j], chat->kv_tokens.size() + j, chat->seq, j + 1 == chat->pending.size());
+            }
+            logits_index[i] = batch.n_tokens - 1;
+        }
+
+        // Observed messages ride along, they are the first to go when the cache is full
+        const int n_gen_tokens = batch.n_tokens;
+        std::int64_t budget = std::min<std::int64_t>(LLAMA_PREFILL_CHUNK, n_ctx - batch.n_tokens);
+        riders.clear();
+        for (Llama_Chat *chat : prefilling) {
+            if (budget <= 0) break;
+            if (chat->adapter != active_adapter) continue;
+            size_t n = std::min<size_t>(budget, chat->pending.size());
+            for (size_t j = 0; j < n; j++) batch_add(batch, chat->pending[j], chat->kv_tokens.size() + j, chat->seq, false);
+            riders.push_back({chat, n});
+            budget -= n;
+        }
+
+        kv_dirty = true;
+        int err;
+        while ((err = llama_decode(ctx, batch)) == 1) {
+            if (!riders.empty()) {
+                batch.n_tokens = n_gen_tokens;
+                riders.clear();
+                continue;
+            }
+            // No room in the KV cache: make some by dropping chats that are not generating
+            Llama_Chat *lru = idle_resident_chat(nullptr);
+            if (lru != nullptr) {
+                page_out(lru);
+                continue;
+            }
+            // Still none: the last chat waits for the next step, it is still
+            // running and the cells of the others may be free by then
+            if (packed.size() == 1) break;
+            batch.n_tokens = starts[packed.size() - 1];
+            packed.pop_back();
+        }
+
+        for (const Llama_Prefill &p : riders) {
+            Llama_Chat *chat = p.chat;
+            if (err != 0) {
+                llama_kv_self_seq_rm(ctx, chat->seq, chat->kv_tokens.size(), -1);
+                continue;
+            }
+            chat->kv_tokens.insert(chat->kv_tokens.end(), chat->pending.begin(), chat->pending.begin() + p.n_tokens);
+            chat->pending.erase(chat->pending.begin(), chat->pending.begin() + p.n_tokens);
+            n_observed_tokens += p.n_tokens;
+            if (chat->pending.empty()) stop_prefill(chat);
+        }
+
+        for (size_t i = 0; i < packed.size(); i++) {
+            Llama_Chat *chat = packed[i];
+            Gen_Request &req = *chat->req;
+            if (err != 0) {
+                fputs("ERROR: Could not decode\n", stderr);
+                fail(chat, req);
+                continue;
+            }
+            chat->kv_tokens.insert(chat->kv_tokens.end(), chat->pending.begin(), chat->pending.end());
+            chat->pending.clear();
+
+            llama_token new_token_id = llama_sampler_sample(chat->penalized ? chat->penalty_smpl : smpl, ctx, logits_index[i]);
+            std::uint32_t first_end;
+            if (chat->loop.is_loop(new_token_id, &first_end)) {
+                req.stats.n_loops += 1;
+                if (loop_penalty > 0.0f && !chat->penalized) {
+                    penalize(chat);
+                    new_token_id = llama_sampler_sample(chat->penalty_smpl, ctx, logits_index[i]);
+                } else {
+                    // Keep the text up to the end of the first occurrence
+                    req.response.resize(chat->offsets[first_end]);
+                    req.status = GEN_DONE;
+                    finish(chat, req);
+                    continue;
+                }
+            }
+            chat->loop.push(new_token_id);
+            if (req.score) req.stats.log_prob += token_log_prob(logits_index[i], new_token_id);
+            if (llama_vocab_is_eog(vocab, new_token_id)) {
+                req.status = GEN_DONE;
+                finish(chat, req);
+                continue;
+            }
+
+            char buf[256];
+            int n = llama_token_to_piece(vocab, new_token_id, buf, sizeof(buf), 0, true);
+            if (n < 0) {
+                fputs("ERROR: Could not convert token to piece\n", stderr);
+                fail(chat, req);
+                continue;
+            }
+
+            chat->pending.push_back(new_token_id);
+            bool more = emit(req, buf, n);
+            chat->offsets.push_back(req.response.size());
+            if (!more) finish(chat, req);
+        }
+        packed.clear();
+    }
+
+    // Requests with a different adapter than the first running one are left for the next batch
+    virtual void step_batch(Gen_Request **reqs, size_t n_reqs) override
+    {
+        active.clear();
+        bool has_adapter = false;
+        Llama_Adapter *adapter = nullptr;
+        for (size_t i = 0; i < n_reqs; i++) {
+            Gen_Request &req = *reqs[i];
+            if (req.status != GEN_RUNNING) continue;
+            Llama_Chat *chat = chats[{req.chat_id, req.thread_id}];
+            if (should_stop(req)) {
+                finish(chat, req);
+                continue;
+            }
+            if ((std::int64_t)(chat->kv_tokens.size() + chat->pending.size()) > n_ctx) {
+                fputs("ERROR: Context size exceeded\n", stderr);
+                fail(chat, req);
+                continue;
+            }
+            if (!has_adapter) {
+                adapter = chat->adapter;
+                has_adapter = true;
+            }
+            if (chat->adapter == adapter) active.push_back(chat);
+        }
+        if (active.empty()) return;
+
+        use_adapter(adapter);
+
+        std::int64_t n_packed = 0;
+        for (Llama_Chat *chat : active) {
+            if (n_packed + (std::int64_t)chat->pending.size() > n_ctx) {
+                decode_packed();
+                n_packed = 0;
+            }
+            packed.push_back(chat);
+            n_packed += chat->pending.size();
+        }
+        decode_packed();
+    }
+
+    Llama_Message *find_message(Llama_Chat *chat, std::int64_t message_id)
+    {
+        if (message_id == 0) return nullptr;
+        for (Llama_Message &m : chat->history) {
+            if (m.id == message_id) return &m;
+        }
+        for (Llama_Message &m : chat->held) {
+            if (m.id == message_id) return &m;
+        }
+        return nullptr;
+    }
+
+    // Drops the sequence from `pos` on, the next `begin` decodes only the rest.
+    // A running reply keeps its context, the next `begin` fixes it up
+    void truncate(Llama_Chat *chat, size_t pos)
+    {
+        stop_prefill(chat);
+        if (chat->req != nullptr || pos >= chat->kv_tokens.size()) return;
+        if (chat->seq >= 0) {
+            kv_dirty = true;
+            if (!llama_kv_self_seq_rm(ctx, chat->seq, pos, -1)) {
+                llama_kv_self_seq_rm(ctx, chat->seq, -1, -1);
+                pos = 0;
+            }
+        }
+        // A paged out sequence is restored whole, `begin` removes the rest
+        chat->kv_tokens.resize(pos);
+    }
+
+    // NOTE: The memory keeps the original text, it is append-only.
+    // Threads have their own copy of the messages they share with the chat
+    virtual void edit_message(std::int64_t chat_id, std::int64_t message_id, const std::string &text) override
+    {
+        for (auto &it : chats) {
+            Llama_Chat *chat = it.second;
+            if (chat->id != chat_id) continue;
+            Llama_Message *m = find_message(chat, message_id);
+            if (m == nullptr) continue;
+            free((void *)m->msg.content);
+            m->msg.content = strdup(text.c_str());
+            truncate(chat, m->pos);
+        }
+    }
+
+    virtual void delete_message(std::int64_t chat_id, std::int64_t message_id) override
+    {
+        for (auto &it : chats) {
+            Llama_Chat *chat = it.second;
+            if (chat->id != chat_id) continue;
+            Llama_Message *m = find_message(chat, message_id);
+            if (m == nullptr) continue;
+            // The running reply answers the last message, it goes when the reply is finished
+            if (chat->req != nullptr && m == &chat->history.back()) continue;
+            free((void *)m->msg.content);
+            if (m >= chat->held.data() && m < chat->held.data() + chat->held.size()) {
+                chat->held.erase(chat->held.begin() + (m - chat->held.data()));
+                continue;
+            }
+            size_t pos = m->pos;
+            chat->history.erase(chat->history.begin() + (m - chat->history.data()));
+            truncate(chat, pos);
+        }
+    }
+
+    // Remembers the (possibly cut) response. An empty one is not sent, the
+    // caller sends a text of its own instead
+    void finish(Llama_Chat *chat, Gen_Request &req)
+    {
+        if (!req.response.empty()) {
+            chat->history.push_back({{"assistant", strdup(req.response.c_str())}, 0, chat->prompt_end});
+            remember(chat, chat->history.back());
+        }
+        chat->req = nullptr;
+        chat->pending.clear();
+        chat->t_last_used = now_seconds();
+        add_held(chat);
+    }
+
+    // Forgets the input unless it was observed, the context is fixed up by the next `begin`
+    bool fail(Llama_Chat *chat, Gen_Request &req)
+    {
+        req.status = GEN_ERROR;
+        if (chat->input_added) {
+            free((void *)chat->history.back().msg.content);
+            chat->history.pop_back();
+        }
+        chat->req = nullptr;
+        chat->pending.clear();
+        add_held(chat);
+        return false;
+    }
+};
+
+static inline bool load_generator(const char *file_path, Generator **res, std::uint32_t seed);
+
+// Runs cheap generators first and the last (expensive) one only when needed.
+// The stages are listed in a `.cascade` file, one per line:
+//
+//     small.bpe 20
+//     model.gguf -c 4096 "You are a helpful comrade"
+//
+// A message starts at the first stage unless the routing policy sends it
+// straight to the last one: addressed, long messages, questions and chosen
+// chats go there. An answer of an earlier stage that reads the input is
+// taken when the stage is confident enough, otherwise the message is
+// escalated. A stage that doesn't read the input (BPE) can't tell, its answer
+// is taken as is: only the routing keeps the messages that matter from it.
+// All but the last stage run to completion inside `begin`, so they should be
+// cheap
+struct CascadeGenerator : Generator {
+    std::vector<Generator *> stages;
+    std::vector<std::vector<std::string>> stage_args; // `parse_args` of the stages may keep pointers
+    std::vector<std::vector<char *>> stage_argv;
+
+    std::int64_t long_message = CASCADE_LONG_MESSAGE;
+    double min_confidence = CASCADE_CONFIDENCE;
+    std::int64_t max_running = -1; // on the last stage before messages stop escalating, -1 is its max_batch
+    std::vector<std::int64_t> llm_chats;
+
+    std::int64_t n_running = 0;
+    Gen_Request probe;
+    std::vector<Gen_Request *> last_reqs;
+
+    virtual ~CascadeGenerator() override
+    {
+        for (Generator *stage : stages) delete stage;
+    }
+
+    static bool split_args(const std::string &line, std::vector<std::string> &res)
+    {
+        res.clear();
+        size_t i = 0;
+        while (true) {
+            while (i < line.size() && isspace((unsigned char)line[i])) i++;
+            if (i >= line.size() || line[i] == '#') return true;
+
+            std::string arg;
+            if (line[i] == '"') {
+                size_t end = line.find('"', i + 1);
+                if (end == std::string::npos) return false;
+                arg = line.substr(i + 1, end - i - 1);
+                i = end + 1;
+            } else {
+                while (i < line.size() && !isspace((unsigned char)line[i])) arg.push_back(line[i++]);
+            }
+            res.push_back(std::move(arg));
+        }
+    }
+
+    virtual bool load(const char *path) override
+    {
+        std::ifstream ifs(path);
+        if (!ifs.good()) {
+            fprintf(stderr, "ERROR: Could not open file '%s'\n", path);
+            return false;
+        }
+
+        size_t line_number = 0;
+        std::string line;
+        std::vector<std::string> args;
+        while (std::getline(ifs, line)) {
+            line_number += 1;
+            if (!split_args(line, args)) {
+                fprintf(stderr, "%s:%zu: ERROR: Unterminated quote\n", path, line_number);
+                return false;
+            }
+            if (!args.empty()) stage_args.push_back(args);
+        }
+
+        if (stage_args.size() < 2) {
+            fprintf(stderr, "ERROR: Cascade %s must have at least two stages\n", path);
+            return false;
+        }
+
+        stage_argv.resize(stage_args.size());
+        for (size_t i = 0; i < stage_args.size(); i++) {
+            for (std::string &arg : stage_args[i]) stage_argv[i].push_back(&arg[0]);
+
+            Generator *stage = nullptr;
+            if (!load_generator(stage_argv[i][0], &stage, seed)) {
+                delete stage;
+                return false;
+            }
+            stages.push_back(stage);
+            if (!stage->parse_args(stage_argv[i].size() - 1, stage_argv[i].data() + 1)) return false;
+        }
+
+        return true;
+    }
+
+    void usage()
+    {
+        fprintf(stderr, "CASCADE ARGS: [OPTIONS]\n");
+        fprintf(stderr, "    -L <bytes>      messages at least this long go straight to the last stage (default: %d)\n", CASCADE_LONG_MESSAGE);
+        fprintf(stderr, "    -t <0..1>       escalate when a stage that reads the input is less confident than this (default: %.2f)\n", CASCADE_CONFIDENCE);
+        fprintf(stderr, "    -r <count>      stop escalating while the last stage runs this many requests (default: its batch size)\n");
+        fprintf(stderr, "    -c <chat-id>    always answer the chat with the last stage, may be repeated\n");
+    }
+
+    virtual bool parse_args(int argc, char **argv) override
+    {
+        while (argc > 0) {
+            if (argc < 2 || argv[0][0] != '-') {
+                usage();
+                return false;
+            }
+
+            if (strcmp(argv[0], "-L") == 0) {
+                if (!str_to_int64(argv[1], strlen(argv[1]), &long_message)) {
+                    fprintf(stderr, "ERROR: Invalid message length `%s`\n", argv[1]);
+                    return false;
+                }
+            } else if (strcmp(argv[0], "-t") == 0) {
+                char *end;
+                min_confidence = strtod(argv[1], &end);
+                if (end == argv[1] || *end != '\0' || min_confidence < 0.0 || min_confidence > 1.0) {
+                    fprintf(stderr, "ERROR: Invalid confidence `%s`\n", argv[1]);
+                    return false;
+                }
+            } else if (strcmp(argv[0], "-r") == 0) {
+                if (!str_to_int64(argv[1], strlen(argv[1]), &max_running)) {
+                    fprintf(stderr, "ERROR: Invalid request count `%s`\n", argv[1]);
+                    return false;
+                }
+            } else if (strcmp(argv[0], "-c") == 0) {
+                std::int64_t chat_id;
+                if (!parse_chat_id(argv[1], strlen(argv[1]), &chat_id)) {
+                    fprintf(stderr, "ERROR: Invalid chat id `%s`\n", argv[1]);
+                    return false;
+                }
+                llm_chats.push_back(chat_id);
+            } else {
+                usage();
+                fprintf(stderr, "ERROR: Unknown option %s\n", argv[0]);
+                return false;
+            }
+            argc -= 2; argv += 2;
+        }
+
+        if (max_running < 0) max_running = stages.back()->max_batch();
+        return true;
+    }
+
+    static bool is_question(const std::string &text)
+    {
+        return text.find('?') != std::string::npos || text.find("\xef\xbc\x9f") != std::string::npos; // U+FF1F
+    }
+
+    bool overloaded()
+    {
+        return n_running >= max_running;
+    }
+
+    // The policy: messages addressed to us, long messages, questions and
+    // configured chats deserve the last stage, unless it is busy
+    size_t first_stage(const Gen_Request &req)
+    {
+        if (overloaded()) return 0;
+        if (req.addressed) return stages.size() - 1;
+        if ((std::int64_t)req.input.size() >= long_message) return stages.size() - 1;
+        if (is_question(req.input)) return stages.size() - 1;
+        if (std::find(llm_chats.begin(), llm_chats.end(), req.chat_id) != llm_chats.end()) return stages.size() - 1;
+        return 0;
+    }
+
+    virtual bool begin(Gen_Request &req) override
+    {
+        size_t last = stages.size() - 1;
+        for (size_t i = first_stage(req); i < last; i++) {
+            probe.chat_id = req.chat_id;
+            probe.message_id = req.message_id;
+            probe.thread_id = req.thread_id;
+            probe.input = req.input;
+            probe.deadline = req.deadline;
+            probe.max_tokens = req.max_tokens;
+            probe.score = true;
+            probe.addressed = req.addressed;
+            probe.cancelled = false;
+            if (!stages[i]->generate(probe)) continue;
+            if (probe.status != GEN_DONE && probe.status != GEN_LIMIT) continue;
+            if (stages[i]->reads_input() && confidence(probe) < min_confidence && !overloaded()) continue;
+
+            req.t_start = probe.t_start;
+            req.status = GEN_RUNNING;
+            req.response.clear();
+            req.stats = probe.stats;
+            req.stats.n_gen_tokens = 0;
+            emit(req, probe.response.data(), probe.response.size());
+            req.stats.n_gen_tokens = probe.stats.n_gen_tokens;
+            if (req.status == GEN_RUNNING) req.status = GEN_DONE;
+            return true;
+        }
+
+        if (!stages[last]->begin(req)) return false;
+        n_running += 1;
+        return true;
+    }
+
+    virtual bool step(Gen_Request &req) override
+    {
+        Gen_Request *reqs[] = {&req};
+        step_batch(reqs, 1);
+        return req.status == GEN_RUNNING;
+    }
+
+    // Only the requests of the last stage are still running
+    virtual void step_batch(Gen_Request **reqs, size_t n_reqs) override
+    {
+        last_reqs.clear();
+        for (size_t i = 0; i < n_reqs; i++) {
+            if (reqs[i]->status == GEN_RUNNING) last_reqs.push_back(reqs[i]);
+        }
+        if (last_reqs.empty()) return;
+
+        stages.back()->step_batch(last_reqs.data(), last_reqs.size());
+        for (Gen_Request *req : last_reqs) {
+            if (req->status != GEN_RUNNING) n_running -= 1;
+        }
+    }
+
+    virtual int batch_group(std::int64_t chat_id) override
+    {
+        return stages.back()->batch_group(chat_id);
+    }
+
+    virtual size_t max_batch() override
+    {
+        return stages.back()->max_batch();
+    }
+
+    virtual double bytes_per_token() override
+    {
+        return stages.back()->bytes_per_token();
+    }
+
+    virtual void prepare(std::int64_t chat_id, std::int64_t thread_id) override
+    {
+        for (Generator *stage : stages) stage->prepare(chat_id, thread_id);
+    }
+
+    virtual void observe(std::int64_t chat_id, std::int64_t thread_id, std::int64_t message_id,
+                         bool own, const std::string &text) override
+    {
+        for (Generator *stage : stages) stage->observe(chat_id, thread_id, message_id, own, text);
+    }
+
+    virtual void backfill(std::int64_t chat_id, std::int64_t thread_id, const std::vector<Gen_Message> &messages) override
+    {
+        for (Generator *stage : stages) stage->backfill(chat_id, thread_id, messages);
+    }
+
+    virtual bool score_reply(std::int64_t chat_id, std::int64_t thread_id, const std::string &input,
+                             const std::string &reply, double *log_prob, std::int64_t *n_tokens) override
+    {
+        return stages.back()->score_reply(chat_id, thread_id, input, reply, log_prob, n_tokens);
+    }
+
+    virtual void edit_message(std::int64_t chat_id, std::int64_t message_id, const std::string &text) override
+    {
+        for (Generator *stage : stages) stage->edit_message(chat_id, message_id, text);
+    }
+
+    virtual void delete_message(std::int64_t chat_id, std::int64_t message_id) override
+    {
+        for (Generator *stage : stages) stage->delete_message(chat_id, message_id);
+    }
+
+    virtual bool idle() override
+    {
+        bool more = false;
+        for (Generator *stage : stages) more = stage->idle() || more;
+        return more;
+    }
+
+    virtual void print_stats(FILE *f) override
+    {
+        for (Generator *stage : stages) stage->print_stats(f);
+    }
+
+    virtual bool has_chat(std::int64_t chat_id, std::int64_t thread_id) override
+    {
+        for (Generator *stage : stages) {
+            if (stage->has_chat(chat_id, thread_id)) return true;
+        }
+        return false;
+    }
+
+    virtual void move_idle_chats(Generator *to) override
+    {
+        CascadeGenerator *next = dynamic_cast<CascadeGenerator *>(to);
+        for (size_t i = 0; i < stages.size(); i++) {
+            Generator *target = to;
+            if (next != nullptr) target = i < next->stages.size() ? next->stages[i] : nullptr;
+            else if (i + 1 < stages.size()) target = nullptr;
+            stages[i]->move_idle_chats(target);
+        }
+    }
+};
+
+// The process-wide state the generators depend on: the locale of the BPE
+// pieces and the backends of llama.cpp. Called once, before any generator is
+// loaded, because generators may load on a thread while others are running
+static inline void generators_init()
+{
+    setlocale(LC_ALL, "");
+    llama_log_set([](enum ggml_log_level, const char *, void *) {}, nullptr);
+    ggml_backend_load_all();
+}
+
+static inline bool load_generator(const char *file_path, Generator **res, std::uint32_t seed = LLAMA_DEFAULT_SEED)
+{
+    // Get extension
+    size_t len = strlen(file_path);
+    const char *extension = &file_path[len-1];
+    while (*extension != '.') {
+        if (extension == file_path) {
+            fprintf(stderr, "ERROR: Could not identify the generator: filename doesn't have an extension\n");
+            return false;
+        }
+        extension -= 1;
+    }
+
+    if (strcmp(extension, ".gguf") == 0) {
+        *res = new LlamaGenerator{};
+    } else if (strcmp(extension, ".bpe") == 0) {
+        *res = new BpeGenerator{};
+    } else if (strcmp(extension, ".cascade") == 0) {
+        *res = new CascadeGenerator{};
+    } else {
+        fprintf(stderr, "ERROR: Unknown generator type `%s`\n", extension);
+        return false;
+    }
+
+    (*res)->seed = seed;
+    return (*res)->load(file_path);
+}
+
+#endif // GENERATOR_H_
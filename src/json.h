@@ -0,0 +1,96 @@
+#ifndef JSON_H_
+#define JSON_H_
+
+// Just enough JSON for flat one-line objects (corpora, recordings), this is not a parser
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string>
+
+// Finds `"key":` in a flat JSON object and returns the position of the value
+static inline const char *json_find_value(const std::string &line, const char *key)
+{
+    std::string pattern = std::string("\"") + key + "\"";
+    size_t pos = line.find(pattern);
+    if (pos == std::string::npos) return nullptr;
+
+    const char *p = line.c_str() + pos + pattern.size();
+    while (isspace(*p)) p++;
+    if (*p != ':') return nullptr;
+    p++;
+    while (isspace(*p)) p++;
+    return p;
+}
+
+static inline bool json_parse_string(const char *p, std::string &res)
+{
+    if (*p != '"') return false;
+    p++;
+
+    res.clear();
+    while (*p != '"') {
+        if (*p == '\0') return false;
+        if (*p != '\\') {
+            res.push_back(*p++);
+            continue;
+        }
+
+        p++;
+        switch (*p) {
+        case 'n': res.push_back('\n'); break;
+        case 't': res.push_back('\t'); break;
+        case 'r': res.push_back('\r'); break;
+        case 'b': res.push_back('\b'); break;
+        case 'f': res.push_back('\f'); break;
+        case 'u': {
+            unsigned cp = 0;
+            for (int i = 1; i <= 4; i++) {
+                if (!isxdigit(p[i])) return false;
+                cp = cp*16 + (isdigit(p[i]) ? p[i]-'0' : (tolower(p[i])-'a'+10));
+            }
+            p += 4;
+            // NOTE: surrogate pairs are not combined, the corpus is expected to be mostly BMP
+            if (cp < 0x80) {
+                res.push_back(cp);
+            } else if (cp < 0x800) {
+                res.push_back(0xC0 | (cp >> 6));
+                res.push_back(0x80 | (cp & 0x3F));
+            } else {
+                res.push_back(0xE0 | (cp >> 12));
+                res.push_back(0x80 | ((cp >> 6) & 0x3F));
+                res.push_back(0x80 | (cp & 0x3F));
+            }
+        } break;
+        case '\0': return false;
+        default: res.push_back(*p); break;
+        }
+        p++;
+    }
+
+    return true;
+}
+
+static inline void print_json_string(FILE *f, const char *str)
+{
+    fputc('"', f);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') fprintf(f, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20) fprintf(f, "\\u%04x", *str);
+        else fputc(*str, f);
+    }
+    fputc('"', f);
+}
+
+// Accepts either a string or a bare literal (number, true, ...) as text
+static inline bool json_parse_scalar(const char *p, std::string &res)
+{
+    if (*p == '"') return json_parse_string(p, res);
+
+    const char *end = p;
+    while (*end && *end != ',' && *end != '}' && *end != ']' && !isspace(*end)) end++;
+    res = std::string(p, end);
+    return end != p;
+}
+
+#endif // JSON_H_
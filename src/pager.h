@@ -0,0 +1,133 @@
+#ifndef PAGER_H_
+#define PAGER_H_
+
+// Disk-backed store of the KV cache states of the chats that were pushed out
+// of the context. The states only make sense for the context that saved
+// them, so the file is anonymous: it is created in the given directory and
+// unlinked right away.
+//
+// Every state is an extent of one mmapped file. Freed extents are reused
+// first-fit and merged with their neighbours; the file grows by doubling.
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define KV_PAGER_ALIGN        4096
+#define KV_PAGER_INITIAL_SIZE (64ull << 20)
+
+struct Kv_Extent {
+    std::uint64_t offset;
+    std::uint64_t size;
+};
+
+struct Kv_Pager {
+    std::string path;
+    int fd = -1;
+    std::uint8_t *map = nullptr;
+    std::uint64_t map_size = 0;
+    std::uint64_t end = 0; // everything past it is free
+    std::vector<Kv_Extent> free_extents; // sorted by offset
+
+    bool is_open() const { return fd >= 0; }
+
+    bool open(const char *dir)
+    {
+        path = std::string(dir) + "/tgcomrade-kv-XXXXXX";
+        fd = mkstemp(&path[0]);
+        if (fd < 0) {
+            fprintf(stderr, "ERROR: Could not create file %s: %s\n", path.c_str(), strerror(errno));
+            return false;
+        }
+        unlink(path.c_str());
+        return grow(KV_PAGER_INITIAL_SIZE);
+    }
+
+    void close()
+    {
+        if (map != nullptr) munmap(map, map_size);
+        if (fd >= 0) ::close(fd);
+        map = nullptr;
+        map_size = 0;
+        fd = -1;
+    }
+
+    bool grow(std::uint64_t size)
+    {
+        if (ftruncate(fd, size) < 0) {
+            fprintf(stderr, "ERROR: Could not resize file %s: %s\n", path.c_str(), strerror(errno));
+            return false;
+        }
+        // The old mapping stays until the new one exists, the paged out
+        // states are still read through it when the file can't be mapped
+        std::uint8_t *grown = (std::uint8_t *)mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (grown == MAP_FAILED) {
+            fprintf(stderr, "ERROR: Could not map file %s: %s\n", path.c_str(), strerror(errno));
+            if (ftruncate(fd, map_size) < 0) {
+                fprintf(stderr, "ERROR: Could not resize file %s: %s\n", path.c_str(), strerror(errno));
+            }
+            return false;
+        }
+        if (map != nullptr) munmap(map, map_size);
+        map = grown;
+        map_size = size;
+        return true;
+    }
+
+    bool alloc(std::uint64_t size, Kv_Extent *res)
+    {
+        size = (size + KV_PAGER_ALIGN - 1)/KV_PAGER_ALIGN*KV_PAGER_ALIGN;
+
+        for (size_t i = 0; i < free_extents.size(); i++) {
+            Kv_Extent &e = free_extents[i];
+            if (e.size < size) continue;
+            *res = {e.offset, size};
+            e.offset += size;
+            e.size -= size;
+            if (e.size == 0) free_extents.erase(free_extents.begin() + i);
+            return true;
+        }
+
+        if (end + size > map_size && !grow(std::max(2*map_size, end + size))) return false;
+        *res = {end, size};
+        end += size;
+        return true;
+    }
+
+    void release(Kv_Extent extent)
+    {
+        // The pages are not needed anymore, don't write them back
+        madvise(map + extent.offset, extent.size, MADV_REMOVE);
+
+        auto it = std::lower_bound(free_extents.begin(), free_extents.end(), extent,
+                                   [](const Kv_Extent &a, const Kv_Extent &b) { return a.offset < b.offset; });
+        it = free_extents.insert(it, extent);
+        if (it + 1 != free_extents.end() && it->offset + it->size == (it + 1)->offset) {
+            it->size += (it + 1)->size;
+            free_extents.erase(it + 1);
+        }
+        if (it != free_extents.begin() && (it - 1)->offset + (it - 1)->size == it->offset) {
+            (it - 1)->size += it->size;
+            it = free_extents.erase(it) - 1;
+        }
+        if (it->offset + it->size == end) {
+            end = it->offset;
+            free_extents.erase(it);
+        }
+    }
+
+    std::uint8_t *data(const Kv_Extent &extent)
+    {
+        return map + extent.offset;
+    }
+};
+
+#endif // PAGER_H_
@@ -0,0 +1,176 @@
+#ifndef POLICY_H_
+#define POLICY_H_
+
+// Decides which messages deserve a reply before anything is generated.
+// Messages addressed to us (mentions, replies to our messages, private
+// chats) and messages with a keyword are always answered, others with the
+// probability of the chat. Cooldowns and per-user rate limits apply on top.
+//
+// Everything is decided from a few fields of the message and a bit of state,
+// in microseconds.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+#define POLICY_OWN_MESSAGES 1024 // ids of our last messages, to detect replies to them
+#define POLICY_RATE_WINDOW  60.0 // seconds of the per-user rate limit
+
+enum Policy_Decision {
+    POLICY_ADDRESSED,  // reply: mentioned, replied to or a private chat
+    POLICY_KEYWORD,    // reply: contains a keyword
+    POLICY_CHANCE,     // reply: picked by the probability of the chat
+    POLICY_IGNORED,    // no reply: not picked
+    POLICY_COOLDOWN,   // no reply: we replied in the chat too recently
+    POLICY_RATE_LIMIT, // no reply: the sender got too many replies
+    POLICY_DECISION_COUNT,
+};
+
+// Replies in a chat that are not addressed to us, 0 for the default
+struct Policy_Chat {
+    std::int64_t chat_id;
+    double probability;
+    double cooldown; // seconds between our unsolicited replies, negative for the default
+};
+
+struct Policy_Message {
+    std::int64_t chat_id;
+    std::int64_t message_id;
+    std::int64_t sender_id;
+    bool from_user;           // not a chat, e.g. an anonymous admin posting as the group
+    std::int64_t reply_to_id; // 0 if it's not a reply to a message of the chat
+    bool mentioned;
+    const char *text;
+};
+
+struct Policy_Rate {
+    double t_window;
+    std::int64_t count;
+};
+
+struct Policy {
+    Policy_Chat default_chat = {0, 1.0, 0.0};
+    std::vector<Policy_Chat> chats;
+    std::vector<std::string> keywords;
+    std::int64_t user_rate = 0; // replies per user per POLICY_RATE_WINDOW, 0 means no limit
+
+    std::minstd_rand rng{std::random_device{}()};
+    std::unordered_map<std::int64_t, double> t_last_reply; // per chat
+    std::unordered_map<std::int64_t, Policy_Rate> rates;   // per sender
+    std::int64_t own_chats[POLICY_OWN_MESSAGES] = {};
+    std::int64_t own_messages[POLICY_OWN_MESSAGES] = {};
+    size_t n_own = 0;
+    std::int64_t decisions[POLICY_DECISION_COUNT] = {};
+
+    // `<chat-id>=<probability>[:<cooldown seconds>]`
+    bool parse_chat(const char *arg)
+    {
+        const char *eq = strchr(arg, '=');
+        Policy_Chat chat = {0, 1.0, -1.0};
+        if (eq == nullptr || !parse_chat_id(arg, eq - arg, &chat.chat_id)) return false;
+
+        char *end;
+        chat.probability = strtod(eq + 1, &end);
+        if (end == eq + 1 || chat.probability < 0.0 || chat.probability > 1.0) return false;
+        if (*end == ':') {
+            const char *cooldown = end + 1;
+            chat.cooldown = strtod(cooldown, &end);
+            if (end == cooldown || chat.cooldown < 0.0) return false;
+        }
+        if (*end != '\0') return false;
+
+        chats.push_back(chat);
+        return true;
+    }
+
+    const Policy_Chat &chat(std::int64_t chat_id) const
+    {
+        for (const Policy_Chat &c : chats) {
+            if (c.chat_id == chat_id) return c;
+        }
+        return default_chat;
+    }
+
+    // Our message, replies to it are addressed to us
+    void add_own(std::int64_t chat_id, std::int64_t message_id)
+    {
+        own_chats[n_own%POLICY_OWN_MESSAGES] = chat_id;
+        own_messages[n_own%POLICY_OWN_MESSAGES] = message_id;
+        n_own += 1;
+    }
+
+    bool is_own(std::int64_t chat_id, std::int64_t message_id) const
+    {
+        for (size_t i = 0; i < POLICY_OWN_MESSAGES && i < n_own; i++) {
+            if (own_messages[i] == message_id && own_chats[i] == chat_id) return true;
+        }
+        return false;
+    }
+
+    bool has_keyword(const char *text) const
+    {
+        for (const std::string &k : keywords) {
+            if (strcasestr(text, k.c_str()) != nullptr) return true;
+        }
+        return false;
+    }
+
+    bool is_addressed(const Policy_Message &m) const
+    {
+        // Private chats have the id of the user, groups post as themselves too
+        bool is_private = m.from_user && m.chat_id > 0 && m.chat_id == m.sender_id;
+        return m.mentioned || is_private || (m.reply_to_id != 0 && is_own(m.chat_id, m.reply_to_id));
+    }
+
+    Policy_Decision decide(const Policy_Message &m)
+    {
+        const Policy_Chat &c = chat(m.chat_id);
+        double cooldown = c.cooldown < 0.0 ? default_chat.cooldown : c.cooldown;
+        double t = now_seconds();
+
+        Policy_Decision d;
+        if (is_addressed(m)) {
+            d = POLICY_ADDRESSED;
+        } else if (has_keyword(m.text)) {
+            d = POLICY_KEYWORD;
+        } else if (c.probability >= 1.0 || std::uniform_real_distribution<double>(0.0, 1.0)(rng) < c.probability) {
+            d = POLICY_CHANCE;
+        } else {
+            d = POLICY_IGNORED;
+        }
+
+        // Only the replies picked by chance cool down
+        auto last = t_last_reply.find(m.chat_id);
+        if (d == POLICY_CHANCE && last != t_last_reply.end() && t - last->second < cooldown) {
+            d = POLICY_COOLDOWN;
+        }
+
+        if (d <= POLICY_CHANCE && user_rate > 0) {
+            Policy_Rate &rate = rates[m.sender_id];
+            if (t - rate.t_window >= POLICY_RATE_WINDOW) rate = {t, 0};
+            if (rate.count >= user_rate) d = POLICY_RATE_LIMIT;
+            else rate.count += 1;
+        }
+
+        if (d <= POLICY_CHANCE) t_last_reply[m.chat_id] = t;
+        decisions[d] += 1;
+        return d;
+    }
+
+    void print_stats(FILE *f) const
+    {
+        fprintf(f, "Policy: replied to %ld addressed, %ld keyword and %ld picked messages; "
+                   "ignored %ld, %ld cooling down, %ld rate limited\n",
+                (long)decisions[POLICY_ADDRESSED], (long)decisions[POLICY_KEYWORD], (long)decisions[POLICY_CHANCE],
+                (long)decisions[POLICY_IGNORED], (long)decisions[POLICY_COOLDOWN], (long)decisions[POLICY_RATE_LIMIT]);
+    }
+};
+
+#endif // POLICY_H_
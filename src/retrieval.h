@@ -0,0 +1,152 @@
+#ifndef RETRIEVAL_H_
+#define RETRIEVAL_H_
+
+// Long-term memory of a chat: every message is embedded with a small
+// embedding model and the most similar old messages are brought back into
+// the prompt instead of keeping the whole history in the context.
+
+#include <stdio.h>
+#include <math.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <llama.h>
+
+#include "vecstore.h"
+
+#define RETRIEVAL_MAX_MESSAGE_TOKENS 512
+
+struct Embedder {
+    llama_model *model = nullptr;
+    const llama_vocab *vocab = nullptr;
+    llama_context *ctx = nullptr;
+    int dim;
+    std::vector<llama_token> tokens;
+
+    bool load(const char *model_path)
+    {
+        puts("Loading embedding model...");
+
+        llama_model_params model_params = llama_model_default_params();
+        model = llama_model_load_from_file(model_path, model_params);
+        if (!model) {
+            fputs("ERROR: Could not load embedding model from file\n", stderr);
+            return false;
+        }
+
+        vocab = llama_model_get_vocab(model);
+        dim = llama_model_n_embd(model);
+
+        // Non-causal models have to see the whole message in one ubatch
+        llama_context_params ctx_params = llama_context_default_params();
+        ctx_params.n_ctx = RETRIEVAL_MAX_MESSAGE_TOKENS;
+        ctx_params.n_batch = RETRIEVAL_MAX_MESSAGE_TOKENS;
+        ctx_params.n_ubatch = RETRIEVAL_MAX_MESSAGE_TOKENS;
+
+        ctx = llama_init_from_model(model, ctx_params);
+        if (!ctx) {
+            fputs("ERROR: Could not create embedding context\n", stderr);
+            unload();
+            return false;
+        }
+        llama_set_embeddings(ctx, true);
+
+        if (llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_NONE) {
+            fputs("ERROR: Embedding model must pool the embeddings per sequence\n", stderr);
+            unload();
+            return false;
+        }
+
+        return true;
+    }
+
+    // Writes the L2-normalized embedding of the text into `out`
+    bool embed(const std::string &text, float *out)
+    {
+        int n = -llama_tokenize(vocab, text.c_str(), text.size(), NULL, 0, true, false);
+        tokens.resize(n);
+        if (llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), true, false) < 0) {
+            fputs("ERROR: Could not tokenize the message for embedding\n", stderr);
+            return false;
+        }
+        if (tokens.size() > RETRIEVAL_MAX_MESSAGE_TOKENS) tokens.resize(RETRIEVAL_MAX_MESSAGE_TOKENS);
+
+        llama_kv_self_clear(ctx);
+        llama_batch batch = llama_batch_get_one(tokens.data(), tokens.size());
+        int err = llama_model_has_encoder(model) && !llama_model_has_decoder(model)
+            ? llama_encode(ctx, batch)
+            : llama_decode(ctx, batch);
+        if (err) {
+            fputs("ERROR: Could not compute the embedding\n", stderr);
+            return false;
+        }
+
+        const float *e = llama_get_embeddings_seq(ctx, 0);
+        if (e == nullptr) {
+            fputs("ERROR: Could not get the embedding\n", stderr);
+            return false;
+        }
+
+        float norm = sqrtf(dot_f32(e, e, dim));
+        if (norm == 0.0f) norm = 1.0f;
+        for (int i = 0; i < dim; i++) out[i] = e[i]/norm;
+
+        return true;
+    }
+
+    void unload()
+    {
+        if (ctx != nullptr) llama_free(ctx);
+        if (model != nullptr) llama_model_free(model);
+        ctx = nullptr;
+        model = nullptr;
+    }
+};
+
+struct Memory {
+    struct Pending {
+        std::uint32_t role;
+        std::string text;
+    };
+
+    Embedder *embedder;
+    Vec_Store store;
+    std::vector<Pending> pending; // messages are embedded lazily, off the reply path when possible
+    std::vector<float> vector;    // embedding of the last embedded message
+
+    // `path_prefix` may be null to keep the memory in RAM
+    bool open(Embedder *e, const char *path_prefix)
+    {
+        embedder = e;
+        vector.resize(embedder->dim);
+        return store.open(path_prefix, embedder->dim);
+    }
+
+    size_t count() const
+    {
+        return store.count + pending.size();
+    }
+
+    void add(std::uint32_t role, const std::string &text)
+    {
+        pending.push_back({role, text});
+    }
+
+    // The messages stored before a failure are not pending anymore, the
+    // next call starts with the one that failed
+    bool embed_pending()
+    {
+        size_t n_done = 0;
+        bool ok = true;
+        for (; n_done < pending.size(); n_done++) {
+            const Pending &p = pending[n_done];
+            ok = embedder->embed(p.text, vector.data()) && store.append(vector.data(), p.role, p.text);
+            if (!ok) break;
+        }
+        pending.erase(pending.begin(), pending.begin() + n_done);
+        return ok;
+    }
+};
+
+#endif // RETRIEVAL_H_
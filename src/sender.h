@@ -0,0 +1,221 @@
+#ifndef SENDER_H_
+#define SENDER_H_
+
+// Outgoing messages. Every request gets its own id so its response can be
+// matched; a message stays in flight until TDLib reports it sent or failed.
+// Messages are paced per chat and globally to stay under the flood limits of
+// Telegram, a FLOOD_WAIT delays the chat for as long as asked and slows down
+// everything else, other failures are retried with exponential backoff. A
+// reply to a message that is gone is sent once more without the reply, into
+// the same thread.
+
+#include <stdio.h>
+#include <ctype.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+#include <td/telegram/Client.h>
+
+#include "common.h"
+#include "transport.h"
+
+#define SEND_CHAT_INTERVAL       1.0        // seconds between messages to one chat
+#define SEND_GLOBAL_INTERVAL     (1.0/25.0) // seconds between any two messages
+#define SEND_MAX_GLOBAL_INTERVAL 1.0        // slowest the global pace gets after flood waits
+#define SEND_BACKOFF             1.0        // first retry delay, doubles with every attempt
+#define SEND_MAX_ATTEMPTS        5
+#define SEND_FLOOD_CODE          429
+
+struct Outgoing {
+    std::int64_t chat_id;
+    std::int64_t thread_id; // 0 outside of threads and forum topics
+    std::int64_t reply_to;  // 0 to send without replying
+    std::string text;
+    std::int64_t attempts;
+    double t_ready; // not sent before this
+};
+
+struct Sender {
+    Transport *transport;
+    double chat_interval = SEND_CHAT_INTERVAL;
+    double global_interval = SEND_GLOBAL_INTERVAL;
+
+    std::uint64_t next_request_id = 1;
+    std::deque<Outgoing> queue;
+    std::unordered_map<std::uint64_t, Outgoing> in_flight; // by request id, until the response
+    std::unordered_map<std::int64_t, Outgoing> sending;    // by temporary message id, until sent or failed
+    std::unordered_map<std::int64_t, double> t_chat_ready;
+    double t_ready = 0.0;
+
+    std::int64_t n_sent = 0;
+    std::int64_t n_retries = 0;
+    std::int64_t n_flood_waits = 0;
+    std::int64_t n_failed = 0;
+
+    std::uint64_t request_id()
+    {
+        return next_request_id++;
+    }
+
+    void send_message(std::int64_t chat_id, std::int64_t thread_id, std::int64_t reply_to, std::string text)
+    {
+        queue.push_back({chat_id, thread_id, reply_to, std::move(text), 0, 0.0});
+    }
+
+    bool idle() const
+    {
+        return queue.empty() && in_flight.empty() && sending.empty();
+    }
+
+    double chat_ready(std::int64_t chat_id) const
+    {
+        auto it = t_chat_ready.find(chat_id);
+        return it != t_chat_ready.end() ? it->second : 0.0;
+    }
+
+    // Seconds until the next queued message may be sent, negative if there is none
+    double next_wait() const
+    {
+        if (queue.empty()) return -1.0;
+        double t = now_seconds(), wait = -1.0;
+        for (const Outgoing &o : queue) {
+            double w = std::max({0.0, t_ready - t, chat_ready(o.chat_id) - t, o.t_ready - t});
+            if (wait < 0.0 || w < wait) wait = w;
+        }
+        return wait;
+    }
+
+    // Sends what the pacing allows, in order within every chat
+    void flush()
+    {
+        double t = now_seconds();
+        for (auto it = queue.begin(); it != queue.end() && t >= t_ready;) {
+            if (t < chat_ready(it->chat_id) || t < it->t_ready) {
+                ++it;
+                continue;
+            }
+
+            auto send_message = td::td_api::make_object<td::td_api::sendMessage>();
+            send_message->chat_id_ = it->chat_id;
+            send_message->message_thread_id_ = it->thread_id;
+            if (it->reply_to != 0) {
+                send_message->reply_to_ =
+                    td::td_api::make_object<td::td_api::inputMessageReplyToMessage>(it->reply_to, nullptr);
+            }
+            auto content = td::td_api::make_object<td::td_api::inputMessageText>();
+            content->text_ = td::td_api::make_object<td::td_api::formattedText>();
+            content->text_->text_ = it->text;
+            send_message->input_message_content_ = std::move(content);
+
+            std::uint64_t id = request_id();
+            transport->send(id, std::move(send_message));
+            t_chat_ready[it->chat_id] = t + chat_interval;
+            t_ready = t + global_interval;
+            in_flight[id] = std::move(*it);
+            it = queue.erase(it);
+        }
+    }
+
+    // Seconds from `FLOOD_WAIT_17` or `Too Many Requests: retry after 17`
+    static double retry_after(const std::string &message)
+    {
+        size_t end = message.size();
+        while (end > 0 && !isdigit(message[end - 1])) end--;
+        size_t start = end;
+        while (start > 0 && isdigit(message[start - 1])) start--;
+        std::int64_t seconds;
+        if (start == end || !str_to_int64(message.data() + start, end - start, &seconds)) return SEND_BACKOFF;
+        return (double)seconds;
+    }
+
+    // `Message to be replied not found`, `REPLY_MESSAGE_ID_INVALID`, ...
+    static bool is_reply_error(const std::string &message)
+    {
+        std::string lower = message;
+        for (char &c : lower) c = tolower((unsigned char)c);
+        return lower.find("repl") != std::string::npos;
+    }
+
+    void failed(Outgoing o, const td::td_api::error &error)
+    {
+        double t = now_seconds();
+        if (error.code_ == SEND_FLOOD_CODE) {
+            double wait = retry_after(error.message_);
+            t_chat_ready[o.chat_id] = std::max(chat_ready(o.chat_id), t + wait);
+            global_interval = std::min(global_interval*2.0, SEND_MAX_GLOBAL_INTERVAL);
+            n_flood_waits += 1;
+            queue.push_front(std::move(o));
+            return;
+        }
+
+        // The message we reply to was deleted, the reply still makes sense.
+        // It stays in its thread, which no longer follows from the reply
+        if (error.code_ == 400 && o.reply_to != 0 && is_reply_error(error.message_)) {
+            o.reply_to = 0;
+            n_retries += 1;
+            queue.push_front(std::move(o));
+            return;
+        }
+
+        // Requests that are wrong stay wrong
+        o.attempts += 1;
+        if ((error.code_ >= 400 && error.code_ < 500) || o.attempts >= SEND_MAX_ATTEMPTS) {
+            fprintf(stderr, "ERROR: Could not send message to chat %ld: %d %s\n",
+                    (long)o.chat_id, (int)error.code_, error.message_.c_str());
+            n_failed += 1;
+            return;
+        }
+        o.t_ready = t + SEND_BACKOFF*(1 << (o.attempts - 1));
+        n_retries += 1;
+        queue.push_front(std::move(o));
+    }
+
+    void sent()
+    {
+        n_sent += 1;
+        global_interval = std::max(global_interval*0.9, SEND_GLOBAL_INTERVAL);
+    }
+
+    // Returns false if the response is not for a message
+    bool handle_response(td::ClientManager::Response &resp)
+    {
+        auto it = in_flight.find(resp.request_id);
+        if (it == in_flight.end()) return false;
+
+        Outgoing o = std::move(it->second);
+        in_flight.erase(it);
+        if (resp.object->get_id() == td::td_api::error::ID) {
+            failed(std::move(o), static_cast<td::td_api::error &>(*resp.object));
+        } else if (resp.object->get_id() == td::td_api::message::ID) {
+            auto &message = static_cast<td::td_api::message &>(*resp.object);
+            if (message.sending_state_ == nullptr) sent();
+            else sending[message.id_] = std::move(o);
+        }
+        return true;
+    }
+
+    void send_succeeded(std::int64_t old_message_id)
+    {
+        if (sending.erase(old_message_id) != 0) sent();
+    }
+
+    void send_failed(std::int64_t old_message_id, const td::td_api::error &error)
+    {
+        auto it = sending.find(old_message_id);
+        if (it == sending.end()) return;
+        Outgoing o = std::move(it->second);
+        sending.erase(it);
+        failed(std::move(o), error);
+    }
+
+    void print_stats(FILE *f) const
+    {
+        fprintf(f, "Sent %ld messages, %ld retries, %ld flood waits, %ld failed, %zu waiting\n",
+                (long)n_sent, (long)n_retries, (long)n_flood_waits, (long)n_failed,
+                queue.size() + in_flight.size() + sending.size());
+    }
+};
+
+#endif // SENDER_H_
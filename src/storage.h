@@ -0,0 +1,168 @@
+#ifndef STORAGE_H_
+#define STORAGE_H_
+
+// What TDLib keeps on disk. `full` mirrors the chats into local databases,
+// which grow without bound on accounts in many big groups, while the bot
+// only needs the last messages of the served chats and fetches those itself
+// (`-H`). `lean` keeps the chat info so a restart doesn't load every chat
+// again, `minimal` keeps nothing but the session. The session stays in the
+// database directory, the files (downloads, thumbnails, temporary files) may
+// go to another one, e.g. on a tmpfs.
+//
+// The cost is measured as the disk usage of these directories, up to the
+// login and after it. The I/O counters of the process would also count the
+// model loading meanwhile, the KV pager and the memory of the chats.
+
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <cstdint>
+#include <string>
+
+#include <td/telegram/Client.h>
+
+#include "common.h"
+
+#define STORAGE_DEFAULT_DIRECTORY "data"
+#define STORAGE_OPTIMIZE_INTERVAL 3600.0 // seconds between two cleanups of the files
+
+struct Storage_Profile {
+    const char *name;
+    bool file_database;
+    bool chat_info_database;
+    bool message_database;
+    bool optimize; // clean up the files periodically
+};
+
+static const Storage_Profile storage_profiles[] = {
+    {"full",    true,  true,  true,  false},
+    {"lean",    false, true,  false, true},
+    {"minimal", false, false, false, true},
+};
+
+// Bytes the files under `path` take on disk, 0 if there is nothing
+static inline std::int64_t storage_disk_usage(const std::string &path)
+{
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0) return 0;
+    std::int64_t size = (std::int64_t)st.st_blocks*512;
+    if (!S_ISDIR(st.st_mode)) return size;
+
+    DIR *dir = opendir(path.c_str());
+    if (dir == nullptr) return size;
+    while (struct dirent *entry = readdir(dir)) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        size += storage_disk_usage(path + "/" + entry->d_name);
+    }
+    closedir(dir);
+    return size;
+}
+
+struct Storage_Usage {
+    std::int64_t database; // with the files when they are inside
+    std::int64_t files;    // only when they are in a directory of their own
+    double t;
+};
+
+struct Storage {
+    const Storage_Profile *profile = &storage_profiles[0];
+    std::string database_directory = STORAGE_DEFAULT_DIRECTORY;
+    std::string files_directory; // empty for inside the database directory
+
+    Storage_Usage usage_start = {};
+    Storage_Usage usage_login = {};
+    bool logged_in = false;
+    double t_last_optimize = 0.0;
+    std::int64_t n_optimizations = 0;
+
+    bool parse_profile(const char *name)
+    {
+        for (const Storage_Profile &p : storage_profiles) {
+            if (strcmp(p.name, name) == 0) {
+                profile = &p;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void set_parameters(td::td_api::setTdlibParameters &params) const
+    {
+        params.database_directory_ = database_directory;
+        params.files_directory_ = files_directory;
+        params.use_file_database_ = profile->file_database;
+        params.use_chat_info_database_ = profile->chat_info_database;
+        params.use_message_database_ = profile->message_database;
+    }
+
+    Storage_Usage usage() const
+    {
+        Storage_Usage u = {};
+        u.t = now_seconds();
+        u.database = storage_disk_usage(database_directory);
+        if (!files_directory.empty()) u.files = storage_disk_usage(files_directory);
+        return u;
+    }
+
+    // Not called for the mock, nothing is stored then
+    void start()
+    {
+        usage_start = usage();
+    }
+
+    void login()
+    {
+        if (logged_in || usage_start.t == 0.0) return;
+        logged_in = true;
+        usage_login = usage();
+        t_last_optimize = usage_login.t;
+        printf("Storage: %s profile, logged in after %.1fs, database %.1fMB (%+.1fMB)",
+               profile->name, usage_login.t - usage_start.t, usage_login.database/1048576.0,
+               (usage_login.database - usage_start.database)/1048576.0);
+        if (!files_directory.empty()) {
+            printf(", files %.1fMB (%+.1fMB)", usage_login.files/1048576.0,
+                   (usage_login.files - usage_start.files)/1048576.0);
+        }
+        putchar('\n');
+    }
+
+    // The files are cleaned up with the default limits of TDLib
+    bool optimize_due()
+    {
+        if (!profile->optimize || !logged_in || now_seconds() - t_last_optimize < STORAGE_OPTIMIZE_INTERVAL) return false;
+        t_last_optimize = now_seconds();
+        n_optimizations += 1;
+        return true;
+    }
+
+    static td::td_api::object_ptr<td::td_api::optimizeStorage> optimize_request()
+    {
+        auto request = td::td_api::make_object<td::td_api::optimizeStorage>();
+        request->size_ = -1;
+        request->ttl_ = -1;
+        request->count_ = -1;
+        request->immunity_delay_ = -1;
+        return request;
+    }
+
+    void print_stats(FILE *f) const
+    {
+        if (!logged_in) return;
+        Storage_Usage u = usage();
+        double hours = (u.t - usage_login.t)/3600.0;
+        double grown = (u.database + u.files - usage_login.database - usage_login.files)/1048576.0;
+        fprintf(f, "Storage: %s profile, %.1fMB on disk, %+.1fMB since the login (%+.1fMB/h), %ld cleanups\n",
+                profile->name, (u.database + u.files)/1048576.0, grown, hours > 0.0 ? grown/hours : 0.0,
+                (long)n_optimizations);
+    }
+
+    static void print_statistics(FILE *f, const td::td_api::storageStatisticsFast &s)
+    {
+        fprintf(f, "Storage: databases %.1fMB, %d files %.1fMB, log %.1fMB\n",
+                (s.database_size_ + s.language_pack_database_size_)/1048576.0,
+                (int)s.file_count_, s.files_size_/1048576.0, s.log_size_/1048576.0);
+    }
+};
+
+#endif // STORAGE_H_
@@ -0,0 +1,354 @@
+// Offline benchmark: replays a conversation corpus through a generator
+// without touching Telegram and reports the numbers as JSON. Concurrent
+// conversations share the generator and are decoded in one batch.
+//
+// Corpus formats:
+// - plain text: one message per line, an empty line starts a new conversation
+// - `.jsonl`: one object per line, `{"chat": <id>, "text": "<message>"}`,
+//   messages are grouped into conversations by `chat` (optional)
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <algorithm>
+#include <unordered_map>
+#include <sys/resource.h>
+
+#include "generator.h"
+#include "json.h"
+
+#define BENCH_DEFAULT_SEED 1337
+
+struct Bench_Conversation {
+    std::string chat;
+    std::vector<std::string> messages;
+};
+
+struct Bench_Sample {
+    bool ok;
+    double latency;
+    double ttft;
+    std::int64_t n_prompt_tokens;
+    std::int64_t n_gen_tokens;
+    std::int64_t n_loops;
+};
+
+// How likely the generator finds the replies of the corpus, every message
+// scored as the reply to the one before it
+struct Bench_Score {
+    double log_prob;
+    std::int64_t n_tokens;
+    std::int64_t n_replies;
+};
+
+static bool ends_with(const char *str, const char *suffix)
+{
+    size_t n = strlen(str), m = strlen(suffix);
+    return n >= m && strcmp(str + n - m, suffix) == 0;
+}
+
+static bool load_corpus(const char *path, std::vector<Bench_Conversation> &res)
+{
+    std::ifstream ifs(path);
+    if (!ifs.good()) {
+        fprintf(stderr, "ERROR: Could not open file '%s'\n", path);
+        return false;
+    }
+
+    const bool is_jsonl = ends_with(path, ".jsonl");
+    std::unordered_map<std::string, size_t> chats;
+    bool new_conversation = true;
+    size_t line_number = 0;
+    std::string line;
+    while (std::getline(ifs, line)) {
+        line_number += 1;
+
+        if (!is_jsonl) {
+            if (line.empty()) {
+                new_conversation = true;
+                continue;
+            }
+            if (new_conversation) res.push_back({std::to_string(res.size()), {}});
+            new_conversation = false;
+            res.back().messages.push_back(line);
+            continue;
+        }
+
+        if (line.empty()) continue;
+
+        std::string text;
+        const char *value = json_find_value(line, "text");
+        if (value == nullptr || !json_parse_string(value, text)) {
+            fprintf(stderr, "%s:%zu: ERROR: Expected object with string field \"text\"\n", path, line_number);
+            return false;
+        }
+
+        std::string chat;
+        value = json_find_value(line, "chat");
+        if (value != nullptr) json_parse_scalar(value, chat);
+
+        auto it = chats.find(chat);
+        if (it == chats.end()) {
+            it = chats.insert({chat, res.size()}).first;
+            res.push_back({chat, {}});
+        }
+        res[it->second].messages.push_back(std::move(text));
+    }
+
+    return true;
+}
+
+// A conversation being replayed, one message at a time
+struct Bench_Run {
+    size_t conversation;
+    size_t next_message;
+    Gen_Request *req;
+};
+
+static Bench_Sample bench_sample(const Gen_Request &req)
+{
+    Bench_Sample s = {};
+    s.ok = req.status != GEN_ERROR;
+    s.latency = now_seconds() - req.t_start;
+    s.ttft = req.stats.t_first_token;
+    s.n_prompt_tokens = req.stats.n_prompt_tokens;
+    s.n_gen_tokens = req.stats.n_gen_tokens;
+    s.n_loops = req.stats.n_loops;
+    return s;
+}
+
+// Replays up to `concurrency` conversations at a time through the one
+// generator, every running request is stepped in the same batch as in the bot
+static void replay(Generator *generator, const std::vector<Bench_Conversation> &corpus,
+                   size_t concurrency, std::vector<Bench_Sample> &samples)
+{
+    std::vector<Bench_Run> runs;
+    std::vector<Gen_Request *> batch;
+    size_t next_conversation = 0;
+    while (runs.size() < concurrency && next_conversation < corpus.size()) runs.push_back({next_conversation++, 0, nullptr});
+
+    while (!runs.empty()) {
+        for (size_t i = 0; i < runs.size();) {
+            Bench_Run &run = runs[i];
+            const std::vector<std::string> &messages = corpus[run.conversation].messages;
+            if (run.req != nullptr && run.req->status == GEN_RUNNING) {
+                i++;
+                continue;
+            }
+
+            if (run.req != nullptr) {
+                samples.push_back(bench_sample(*run.req));
+                // The conversation state is undefined after a failure
+                if (run.req->status == GEN_ERROR) run.next_message = messages.size();
+                delete run.req;
+                run.req = nullptr;
+            }
+
+            if (run.next_message == messages.size()) {
+                if (next_conversation < corpus.size()) run = {next_conversation++, 0, nullptr};
+                else runs.erase(runs.begin() + i);
+                continue;
+            }
+
+            // Every conversation is a chat of its own, with its own sequence
+            run.req = new Gen_Request{};
+            run.req->chat_id = run.conversation + 1;
+            run.req->input = messages[run.next_message++];
+            if (!generator->begin(*run.req)) run.req->status = GEN_ERROR;
+            // Looked at again: the request may be finished already
+        }
+
+        batch.clear();
+        for (Bench_Run &run : runs) batch.push_back(run.req);
+        if (!batch.empty()) generator->step_batch(batch.data(), batch.size());
+    }
+}
+
+// Runs after the replay, so the scoring doesn't slow down its requests. Every
+// conversation is fed again to a chat of its own without generating: the
+// messages before the scored reply are all in the history as they are in the
+// corpus, so every KV cache type is scored on the same text
+static void score_corpus(Generator *generator, const std::vector<Bench_Conversation> &corpus, Bench_Score *score)
+{
+    for (size_t c = 0; c < corpus.size(); c++) {
+        const std::vector<std::string> &messages = corpus[c].messages;
+        std::int64_t chat_id = corpus.size() + 1 + c;
+        for (size_t i = 0; i + 1 < messages.size(); i++) {
+            double log_prob;
+            std::int64_t n_tokens;
+            if (generator->score_reply(chat_id, 0, messages[i], messages[i + 1], &log_prob, &n_tokens)) {
+                score->log_prob += log_prob;
+                score->n_tokens += n_tokens;
+                score->n_replies += 1;
+            }
+            generator->observe(chat_id, 0, i + 1, false, messages[i]);
+        }
+    }
+}
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty()) return 0.0;
+    size_t i = (size_t)(p*(sorted.size() - 1) + 0.5);
+    return sorted[i];
+}
+
+static void print_json_distribution(FILE *f, const char *name, std::vector<double> &values)
+{
+    std::sort(values.begin(), values.end());
+    double sum = 0.0;
+    for (double v : values) sum += v;
+
+    fprintf(f, "  \"%s\": {\"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f},\n",
+            name,
+            values.empty() ? 0.0 : sum/values.size()*1000.0,
+            percentile(values, 0.50)*1000.0,
+            percentile(values, 0.90)*1000.0,
+            percentile(values, 0.99)*1000.0,
+            values.empty() ? 0.0 : values.back()*1000.0);
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [OPTIONS] <generator> <corpus> [GENERATOR ARGS]\n", program);
+    fprintf(stderr, "OPTIONS:\n");
+    fprintf(stderr, "    -j <count>    number of concurrent conversations, decoded in one batch, at most the\n");
+    fprintf(stderr, "                  batch size of the generator (default: 1)\n");
+    fprintf(stderr, "    -s <seed>     seed of the generator (default: %d)\n", BENCH_DEFAULT_SEED);
+    fprintf(stderr, "    -o <file>     write the JSON report into the file instead of stdout\n");
+    fprintf(stderr, "    -P            report the perplexity of every corpus message as the reply to the one\n");
+    fprintf(stderr, "                  before it, e.g. to compare quantized KV caches (slower, after the timed replay)\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *program = argv[0];
+    std::int64_t concurrency = 1;
+    std::int64_t seed = BENCH_DEFAULT_SEED;
+    const char *output_path = nullptr;
+    bool score = false;
+
+    argc -= 1; argv += 1;
+    while (argc > 0 && argv[0][0] == '-') {
+        if (strcmp(argv[0], "-P") == 0) {
+            score = true;
+            argc -= 1; argv += 1;
+            continue;
+        }
+
+        if (argc < 2) {
+            usage(program);
+            fprintf(stderr, "ERROR: No value for option %s\n", argv[0]);
+            return 1;
+        }
+
+        if (strcmp(argv[0], "-j") == 0) {
+            if (!str_to_int64(argv[1], strlen(argv[1]), &concurrency) || concurrency == 0) {
+                fprintf(stderr, "ERROR: Invalid concurrency `%s`\n", argv[1]);
+                return 1;
+            }
+        } else if (strcmp(argv[0], "-s") == 0) {
+            if (!str_to_int64(argv[1], strlen(argv[1]), &seed)) {
+                fprintf(stderr, "ERROR: Invalid seed `%s`\n", argv[1]);
+                return 1;
+            }
+        } else if (strcmp(argv[0], "-o") == 0) {
+            output_path = argv[1];
+        } else {
+            usage(program);
+            fprintf(stderr, "ERROR: Unknown option %s\n", argv[0]);
+            return 1;
+        }
+        argc -= 2; argv += 2;
+    }
+
+    if (argc < 2) {
+        usage(program);
+        return 1;
+    }
+
+    const char *generator_path = argv[0];
+    const char *corpus_path = argv[1];
+
+    std::vector<Bench_Conversation> corpus;
+    if (!load_corpus(corpus_path, corpus)) return 1;
+
+    generators_init();
+    Generator *generator = nullptr;
+    if (!load_generator(generator_path, &generator, (std::uint32_t)seed)) return 1;
+    if (!generator->parse_args(argc-2, argv+2)) return 1;
+    if ((size_t)concurrency > generator->max_batch()) {
+        fprintf(stderr, "ERROR: The generator runs at most %zu conversations at a time\n", generator->max_batch());
+        return 1;
+    }
+
+    std::vector<Bench_Sample> samples;
+    double t_start = now_seconds();
+    replay(generator, corpus, concurrency, samples);
+    double wall_time = now_seconds() - t_start;
+
+    Bench_Score reply_score = {};
+    if (score) score_corpus(generator, corpus, &reply_score);
+
+    std::vector<double> latencies, ttfts, decode_rates;
+    std::int64_t n_errors = 0, n_prompt_tokens = 0, n_gen_tokens = 0, n_loops = 0;
+    for (const Bench_Sample &s : samples) {
+        if (!s.ok) {
+            n_errors += 1;
+            continue;
+        }
+        latencies.push_back(s.latency);
+        ttfts.push_back(s.ttft);
+        n_prompt_tokens += s.n_prompt_tokens;
+        n_gen_tokens += s.n_gen_tokens;
+        n_loops += s.n_loops;
+        if (s.n_gen_tokens > 1 && s.latency > s.ttft) {
+            decode_rates.push_back((s.n_gen_tokens - 1)/(s.latency - s.ttft));
+        }
+    }
+
+    double decode_rate_mean = 0.0;
+    for (double r : decode_rates) decode_rate_mean += r;
+    if (!decode_rates.empty()) decode_rate_mean /= decode_rates.size();
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    FILE *f = stdout;
+    if (output_path != nullptr) {
+        f = fopen(output_path, "w");
+        if (f == nullptr) {
+            fprintf(stderr, "ERROR: Could not open file %s for writing: %s\n", output_path, strerror(errno));
+            return 1;
+        }
+    }
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"generator\": "); print_json_string(f, generator_path); fprintf(f, ",\n");
+    fprintf(f, "  \"corpus\": "); print_json_string(f, corpus_path); fprintf(f, ",\n");
+    fprintf(f, "  \"concurrency\": %ld,\n", (long)concurrency);
+    fprintf(f, "  \"seed\": %ld,\n", (long)seed);
+    fprintf(f, "  \"conversations\": %zu,\n", corpus.size());
+    fprintf(f, "  \"requests\": %zu,\n", latencies.size() + n_errors);
+    fprintf(f, "  \"errors\": %ld,\n", (long)n_errors);
+    fprintf(f, "  \"wall_time_s\": %.3f,\n", wall_time);
+    fprintf(f, "  \"prompt_tokens\": %ld,\n", (long)n_prompt_tokens);
+    fprintf(f, "  \"generated_tokens\": %ld,\n", (long)n_gen_tokens);
+    fprintf(f, "  \"tokens_per_second\": %.3f,\n", wall_time > 0.0 ? n_gen_tokens/wall_time : 0.0);
+    fprintf(f, "  \"decode_tokens_per_second\": %.3f,\n", decode_rate_mean);
+    fprintf(f, "  \"loops_detected\": %ld,\n", (long)n_loops);
+    if (score) {
+        fprintf(f, "  \"scored_replies\": %ld,\n", (long)reply_score.n_replies);
+        fprintf(f, "  \"reply_perplexity\": %.4f,\n",
+                reply_score.n_tokens > 0 ? exp(-reply_score.log_prob/reply_score.n_tokens) : 0.0);
+    }
+    fprintf(f, "  \"kv_bytes_per_token\": %.0f,\n", generator->bytes_per_token());
+    print_json_distribution(f, "ttft_ms", ttfts);
+    print_json_distribution(f, "latency_ms", latencies);
+    fprintf(f, "  \"peak_rss_kb\": %ld\n", usage.ru_maxrss);
+    fprintf(f, "}\n");
+
+    if (f != stdout) fclose(f);
+
+    return n_errors == 0 ? 0 : 1;
+}
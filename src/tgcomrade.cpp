@@ -1,21 +1,44 @@
 #include <stdio.h>
-#include <assert.h>
-#include <fstream>
 #include <iostream>
 #include <string.h>
-#include <ctype.h>
-#include <clocale>
+#include <signal.h>
+#include <time.h>
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
-#include <llama.h>
-
 #include <td/telegram/Client.h>
 namespace td_api = td::td_api;
 
-#define TG_WAIT_TIME 10.0
+#include "generator.h"
+#include "policy.h"
+#include "sender.h"
+#include "storage.h"
+#include "transport.h"
 
-#define LLAMA_GPU_LAYER_COUNT 99
-#define LLAMA_CONTEXT_SIZE    2048
+#define TG_WAIT_TIME 10.0
+#define TG_STATS_INTERVAL 300.0 // seconds between the stats printed while idle
+#define TG_FALLBACK_REPLY "Sorry, something went wrong"
+#define TG_RELOAD_POLL_TIME 0.5 // how often a finished reload is checked while idle
+#define TG_RECEIVE_BATCH 64 // updates handled at most between two generation steps
+#define TG_BACKLOG_QUIET 2.0 // seconds without missed messages after which the catch-up is over
+#define TG_HISTORY_PAGE 100 // most messages one getChatHistory returns
+
+// How long a message may wait for its batch group (LoRA adapter) before no
+// more messages of the running group are admitted
+#define SCHED_GROUP_HOLD 2.0
+
+// Admission control. Past the degrade thresholds replies are shorter and the
+// overflow goes to the fallback generator, past the shed thresholds new
+// messages are dropped. A level is left when the load drops below half of
+// its thresholds
+#define SCHED_DEGRADE_QUEUE       16
+#define SCHED_DEGRADE_WAIT        10.0 // seconds the oldest message waits
+#define SCHED_SHED_QUEUE          128
+#define SCHED_SHED_WAIT           60.0 // also the age after which a message is never answered
+#define SCHED_DEGRADED_MAX_TOKENS 48
 
 #define LIST_OF_UPDATE_HANDLERS \
     X(updateAuthorizationState, update_auth_state) \
@@ -24,414 +47,1031 @@ namespace td_api = td::td_api;
     X(authorizationStateWaitPhoneNumber, auth_state_wait_phone_number) \
     X(authorizationStateWaitCode, auth_state_wait_code) \
     X(updateNewMessage, update_new_message) \
+    X(updateMessageContent, update_message_content) \
+    X(updateDeleteMessages, update_delete_messages) \
+    X(updateChatAction, update_chat_action) \
+    X(updateMessageSendSucceeded, update_message_send_succeeded) \
+    X(updateMessageSendFailed, update_message_send_failed) \
+
+// A message being answered
+struct Reply {
+    std::int64_t message_id;
+    double t_arrival;
+    Generator *generator; // the one that started it, may be an old one being drained
+    Gen_Request req;
+};
 
-static bool str_to_int64(const char *str, size_t len, std::int64_t *res);
+static void auth_state_wait_code(td_api::object_ptr<td_api::authorizationStateWaitCode>);
+static void auth_state_wait_phone_number(td_api::object_ptr<td_api::authorizationStateWaitPhoneNumber>);
+static void auth_state_ready(td_api::object_ptr<td_api::authorizationStateReady>);
+static void auth_state_wait_tdlib_params(td_api::object_ptr<td_api::authorizationStateWaitTdlibParameters>);
+static void update_auth_state(td_api::object_ptr<td_api::updateAuthorizationState>);
+static void update_new_message(td_api::object_ptr<td_api::updateNewMessage>);
+static void update_message_content(td_api::object_ptr<td_api::updateMessageContent>);
+static void update_delete_messages(td_api::object_ptr<td_api::updateDeleteMessages>);
+static void update_chat_action(td_api::object_ptr<td_api::updateChatAction>);
+static void update_message_send_succeeded(td_api::object_ptr<td_api::updateMessageSendSucceeded>);
+static void update_message_send_failed(td_api::object_ptr<td_api::updateMessageSendFailed>);
+
+enum Load_Level {
+    LOAD_NORMAL,
+    LOAD_DEGRADED,
+    LOAD_SHEDDING,
+};
 
-struct Generator {
-    llama_model *model;
-    const llama_vocab *vocab;
-    llama_context *ctx;
-    llama_sampler *smpl;
-    std::vector<llama_chat_message> messages;
-    std::vector<char> formatted;
-    int prev_formatted_len = 0;
+// Generation budget of the replies in a chat, 0 means no limit
+struct Budget {
+    std::int64_t chat_id;
+    std::int64_t max_tokens;
+    double seconds; // from the arrival of the message
+};
 
-    virtual bool load(const char *file_path) = 0;
-    virtual bool parse_args(int argc, char **argv) = 0;
-    virtual bool gen_response(const std::string &in, std::string &res) = 0;
+// Someone started typing, the conversation is prepared when the bot is idle
+struct Typing {
+    std::int64_t chat_id;
+    std::int64_t thread_id;
 };
 
-struct BpeGenerator : Generator {
-    struct Token {
-        uint32_t value; // may be either `symbol` or `pair_id`
-        bool is_node;
-    };
+// A message that arrived while we were down, or one of the same chat that
+// came after it during the catch-up
+struct Missed_Message {
+    Policy_Message m;
+    std::int64_t thread_id;
+    bool own;
+    std::string text;
+};
 
-    struct Pair {
-        Token l, r;
-        size_t freq;
-    };
+// The last messages of a served chat, fetched at startup for the history
+struct History_Fetch {
+    std::int64_t chat_id;
+    std::int64_t from_message_id; // oldest so far, the next page starts there
+    std::int64_t n_fetched;
+    std::vector<Missed_Message> messages; // newest first
+    bool done;
+};
 
-    std::vector<Pair> pairs;
-    std::vector<Token> next;
-    std::int64_t gen_limit = 10;
+struct Load_Config {
+    std::int64_t degrade_queue;
+    double degrade_wait;
+    std::int64_t shed_queue;
+    double shed_wait;
+    std::int64_t degraded_max_tokens;
+};
 
-    virtual bool load(const char *path) override
-    {
-        puts("Loading bpe pairs...");
+static void process_update(td_api::object_ptr<td_api::Object> u);
+static bool is_served(std::int64_t chat_id);
+static bool is_foreign_update(const td_api::Object &u);
+static void update_load();
+static void schedule();
+static void admit(Reply *r, Generator *g);
+static void step_running();
+static void send_reply(Reply *r);
+static void queue_reply(std::int64_t chat_id, std::int64_t message_id, std::int64_t thread_id, const std::string &text,
+                        bool addressed);
+static void catch_up();
+static bool catch_up_ready();
+static void request_history(size_t i);
+static bool handle_history(td::ClientManager::Response &resp);
+static void reload_start();
+static bool reload_finish();
+static void drain();
+static Generator *chat_owner(std::int64_t chat_id, std::int64_t thread_id);
+
+static Transport    *transport;
+static Sender       sender;
+static Storage      storage;
+static std::vector<std::int64_t> chat_ids;
+static std::int64_t      user_id;
 
-        setlocale(LC_ALL, "");
-        srand(time(0));
+static std::deque<Reply *> pending;
+static std::vector<Reply *> running;
+static std::vector<Gen_Request *> running_reqs;
 
-        std::ifstream ifs(path);
-        std::string bytes((std::istreambuf_iterator<char>(ifs)),
-                          (std::istreambuf_iterator<char>()));
+// NOTE: One-off leak
+static Generator *generator;
+static const char *generator_path;
+static int generator_argc;
+static char **generator_argv;
 
-        if (!ifs.good()) {
-            fprintf(stderr, "ERROR: Could not open file '%s'\n", path);
-            return false;
-        }
+// Generators replaced by a reload that still have running requests
+static std::vector<Generator *> draining;
 
-        if (bytes.size()%sizeof(Pair) != 0) {
-            fprintf(stderr, "%s: file size in bytes (%zu) must be divisible by %zu\n", path, bytes.size(), sizeof(Pair));
-            return false;
-        }
+static Load_Config load_config = {
+    SCHED_DEGRADE_QUEUE, SCHED_DEGRADE_WAIT,
+    SCHED_SHED_QUEUE, SCHED_SHED_WAIT,
+    SCHED_DEGRADED_MAX_TOKENS,
+};
+static Load_Level load_level;
+static std::int64_t n_shed;
+static std::int64_t n_degraded;
+static std::int64_t n_loops;
+static std::int64_t n_updates;
+static std::int64_t n_foreign_updates;
+
+static std::vector<Typing> typing;
+static std::int64_t t_process_start;
+static std::vector<Missed_Message> backlog;
+static std::vector<Missed_Message> unobserved; // with -O, arrived before the model was loaded
+static double t_last_missed;
+static bool catching_up;
+static std::int64_t history_count;
+static bool history_requested;
+static std::vector<History_Fetch> history_fetches;
+static std::unordered_map<std::uint64_t, size_t> history_requests; // request id -> fetch
+static bool observe;
+static Policy policy;
+
+static Budget default_budget;
+static std::vector<Budget> chat_budgets;
+static const char *fallback_reply = TG_FALLBACK_REPLY;
+
+// Serves the overflow while degraded, optional
+static Generator *fallback;
+static std::vector<std::string> fallback_args;
+static std::vector<char *> fallback_argv;
+
+// SIGHUP loads the generator again from `generator_path` in the background
+static volatile sig_atomic_t reload_requested;
+static std::thread reload_thread;
+static std::atomic<bool> reload_done;
+static bool reloading;
+static Generator *reloaded;
+static double t_reload_start;
+
+static bool parse_budget(const char *arg, Budget *budget)
+{
+    const char *eq = strchr(arg, '=');
+    if (eq == nullptr || !parse_chat_id(arg, eq - arg, &budget->chat_id)) return false;
+
+    const char *tokens = eq + 1;
+    const char *colon = strchr(tokens, ':');
+    size_t len = colon != nullptr ? (size_t)(colon - tokens) : strlen(tokens);
+    if (!str_to_int64(tokens, len, &budget->max_tokens)) return false;
+
+    if (colon != nullptr) {
+        char *end;
+        budget->seconds = strtod(colon + 1, &end);
+        if (end == colon + 1 || *end != '\0' || budget->seconds < 0.0) return false;
+    }
+    return true;
+}
 
-        Pair *items = (Pair *)bytes.c_str();
-        size_t count = bytes.size()/sizeof(Pair);
-        for (size_t i = 0; i < count; i++) {
-            pairs.push_back(items[i]);
-        }
+// Options start with '-', but so do the chat ids of groups
+static bool is_option(const char *arg)
+{
+    return arg[0] == '-' && !isdigit((unsigned char)arg[1]);
+}
 
-        return true;
+// `<chat-id>[,<chat-id>...]`
+static bool parse_chat_list(const char *list, std::vector<std::int64_t> &ids)
+{
+    for (const char *id = list;;) {
+        const char *comma = strchr(id, ',');
+        size_t len = comma != nullptr ? (size_t)(comma - id) : strlen(id);
+        std::int64_t chat_id;
+        if (!parse_chat_id(id, len, &chat_id)) return false;
+        ids.push_back(chat_id);
+        if (comma == nullptr) return true;
+        id = comma + 1;
     }
+}
 
-    virtual bool parse_args(int argc, char **argv) override
-    {
-        if (argc == 0) return true;
-        if (argc != 1) {
-            fprintf(stderr, "BPE ARGS: [generation-limit]\n");
-            return false;
-        }
-
-        if (!str_to_int64(argv[0], strlen(argv[0]), &gen_limit)) return false;
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [OPTIONS] <chat-id>[,<chat-id>...] <generator> [GENERATOR ARGS]\n", program);
+    fprintf(stderr, "       %s -m <arrivals> [OPTIONS] [<chat-id>[,<chat-id>...]] <generator> [GENERATOR ARGS]\n", program);
+    fprintf(stderr, "OPTIONS (a group chat id like -1001234 ends them, so does --):\n");
+    fprintf(stderr, "    -m <arrivals>   don't connect to Telegram, synthesize messages instead:\n");
+    fprintf(stderr, "                    poisson:<rate>, bursty:<rate>:<burst> or replay:<file.jsonl>\n");
+    fprintf(stderr, "    -C <count>      mock: number of chats, ids are 1..count (default: 16)\n");
+    fprintf(stderr, "    -N <count>      mock: number of messages (default: 1000)\n");
+    fprintf(stderr, "    -T <file>       mock: message texts, one per line\n");
+    fprintf(stderr, "    -R <file>       mock: record sent messages into the file (default: " MOCK_DEFAULT_RECORD ")\n");
+    fprintf(stderr, "    -b <tokens>     max tokens of a reply (default: no limit)\n");
+    fprintf(stderr, "    -d <seconds>    time from a message to its reply (default: no limit)\n");
+    fprintf(stderr, "    -B <chat-id>=<tokens>[:<seconds>]\n");
+    fprintf(stderr, "                    budget of the replies in the chat, may be repeated\n");
+    fprintf(stderr, "    -f <text>       reply when nothing could be generated in time (default: \"" TG_FALLBACK_REPLY "\")\n");
+    fprintf(stderr, "    -q <count>      degrade when this many messages wait (default: %d)\n", SCHED_DEGRADE_QUEUE);
+    fprintf(stderr, "    -w <seconds>    degrade when the oldest message waits this long (default: %.0f)\n", SCHED_DEGRADE_WAIT);
+    fprintf(stderr, "    -Q <count>      drop new messages when this many wait (default: %d)\n", SCHED_SHED_QUEUE);
+    fprintf(stderr, "    -W <seconds>    drop messages that waited this long, and new ones while any does (default: %.0f)\n", SCHED_SHED_WAIT);
+    fprintf(stderr, "    -M <tokens>     max tokens of a reply while degraded (default: %d)\n", SCHED_DEGRADED_MAX_TOKENS);
+    fprintf(stderr, "    -F \"<generator> [ARGS]\"\n");
+    fprintf(stderr, "                    answer the messages the generator has no room for with this one while degraded\n");
+    fprintf(stderr, "    -a <probability>\n");
+    fprintf(stderr, "                    reply to a message not addressed to us with this probability (default: 1)\n");
+    fprintf(stderr, "    -c <seconds>    time between replies not addressed to us in a chat (default: 0)\n");
+    fprintf(stderr, "    -u <count>      replies per user per minute (default: no limit)\n");
+    fprintf(stderr, "    -k <keyword>    always reply to messages with the keyword, may be repeated\n");
+    fprintf(stderr, "    -P <chat-id>=<probability>[:<seconds>]\n");
+    fprintf(stderr, "                    reply probability and time between replies in the chat, may be repeated\n");
+    fprintf(stderr, "    -S <seconds>    time between messages to one chat (default: %.0f)\n", SEND_CHAT_INTERVAL);
+    fprintf(stderr, "    -O              observe: add every message of the chats to the history as it arrives, also\n");
+    fprintf(stderr, "                    the dropped ones and our own from other devices\n");
+    fprintf(stderr, "    -H <count>      fetch this many last messages of every chat into the history at startup (default: 0)\n");
+    fprintf(stderr, "    -s <profile>    what TDLib stores: full, lean (no message and file databases) or minimal\n");
+    fprintf(stderr, "                    (only the session), the last two clean up the files hourly (default: full)\n");
+    fprintf(stderr, "    -g <dir>        TDLib database directory, keeps the session (default: " STORAGE_DEFAULT_DIRECTORY ")\n");
+    fprintf(stderr, "    -t <dir>        TDLib files directory, e.g. on a tmpfs (default: inside the database directory)\n");
+}
 
-        printf("Generation limit: %zu\n", gen_limit);
+int main(int argc, char **argv)
+{
+    const char *program = argv[0];
+    t_process_start = time(nullptr);
+    bool mock = false;
+    Mock_Config mock_config = {};
+    mock_config.chat_count = 16;
+    mock_config.message_count = 1000;
+    mock_config.record_path = MOCK_DEFAULT_RECORD;
+
+    argc -= 1; argv += 1;
+    while (argc > 0 && is_option(argv[0])) {
+        if (strcmp(argv[0], "--") == 0) {
+            argc -= 1; argv += 1;
+            break;
+        }
+        if (strcmp(argv[0], "-O") == 0) {
+            observe = true;
+            argc -= 1; argv += 1;
+            continue;
+        }
 
-        return true;
-    }
+        if (argc < 2) {
+            usage(program);
+            fprintf(stderr, "ERROR: No value for option %s\n", argv[0]);
+            return 1;
+        }
 
-    void render_token(std::vector<Pair> &pairs, Token token, std::wstring &dest)
-    {
-        if (!token.is_node) {
-            dest.push_back(token.value);
+        if (strcmp(argv[0], "-m") == 0) {
+            if (!mock_parse_arrivals(argv[1], &mock_config)) return 1;
+            mock = true;
+        } else if (strcmp(argv[0], "-C") == 0) {
+            if (!str_to_int64(argv[1], strlen(argv[1]), &mock_config.chat_count) || mock_config.chat_count == 0) {
+                fprintf(stderr, "ERROR: Invalid chat count `%s`\n", argv[1]);
+                return 1;
+            }
+        } else if (strcmp(argv[0], "-N") == 0) {
+            if (!str_to_int64(argv[1], strlen(argv[1]), &mock_config.message_count)) {
+                fprintf(stderr, "ERROR: Invalid message count `%s`\n", argv[1]);
+                return 1;
+            }
+        } else if (strcmp(argv[0], "-T") == 0) {
+            mock_config.texts_path = argv[1];
+        } else if (strcmp(argv[0], "-R") == 0) {
+            mock_config.record_path = argv[1];
+        } else if (strcmp(argv[0], "-q") == 0 || strcmp(argv[0], "-Q") == 0 || strcmp(argv[0], "-M") == 0) {
+            std::int64_t *value = argv[0][1] == 'q' ? &load_config.degrade_queue :
+                                  argv[0][1] == 'Q' ? &load_config.shed_queue :
+                                                      &load_config.degraded_max_tokens;
+            if (!str_to_int64(argv[1], strlen(argv[1]), value) || *value == 0) {
+                fprintf(stderr, "ERROR: Invalid value `%s` for %s\n", argv[1], argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[0], "-w") == 0 || strcmp(argv[0], "-W") == 0) {
+            char *end;
+            double value = strtod(argv[1], &end);
+            if (end == argv[1] || *end != '\0' || value <= 0.0) {
+                fprintf(stderr, "ERROR: Invalid value `%s` for %s\n", argv[1], argv[0]);
+                return 1;
+            }
+            if (argv[0][1] == 'w') load_config.degrade_wait = value;
+            else load_config.shed_wait = value;
+        } else if (strcmp(argv[0], "-b") == 0) {
+            if (!str_to_int64(argv[1], strlen(argv[1]), &default_budget.max_tokens)) {
+                fprintf(stderr, "ERROR: Invalid token count `%s`\n", argv[1]);
+                return 1;
+            }
+        } else if (strcmp(argv[0], "-d") == 0) {
+            char *end;
+            default_budget.seconds = strtod(argv[1], &end);
+            if (end == argv[1] || *end != '\0' || default_budget.seconds < 0.0) {
+                fprintf(stderr, "ERROR: Invalid time `%s`\n", argv[1]);
+                return 1;
+            }
+        } else if (strcmp(argv[0], "-B") == 0) {
+            Budget budget = {};
+            if (!parse_budget(argv[1], &budget)) {
+                fprintf(stderr, "ERROR: Invalid budget `%s`, expected <chat-id>=<tokens>[:<seconds>]\n", argv[1]);
+                return 1;
+            }
+            chat_budgets.push_back(budget);
+        } else if (strcmp(argv[0], "-a") == 0 || strcmp(argv[0], "-c") == 0) {
+            char *end;
+            double value = strtod(argv[1], &end);
+            if (end == argv[1] || *end != '\0' || value < 0.0 || (argv[0][1] == 'a' && value > 1.0)) {
+                fprintf(stderr, "ERROR: Invalid value `%s` for %s\n", argv[1], argv[0]);
+                return 1;
+            }
+            if (argv[0][1] == 'a') policy.default_chat.probability = value;
+            else policy.default_chat.cooldown = value;
+        } else if (strcmp(argv[0], "-S") == 0) {
+            char *end;
+            sender.chat_interval = strtod(argv[1], &end);
+            if (end == argv[1] || *end != '\0' || sender.chat_interval < 0.0) {
+                fprintf(stderr, "ERROR: Invalid time `%s`\n", argv[1]);
+                return 1;
+            }
+        } else if (strcmp(argv[0], "-u") == 0) {
+            if (!str_to_int64(argv[1], strlen(argv[1]), &policy.user_rate)) {
+                fprintf(stderr, "ERROR: Invalid count `%s`\n", argv[1]);
+                return 1;
+            }
+        } else if (strcmp(argv[0], "-H") == 0) {
+            if (!str_to_int64(argv[1], strlen(argv[1]), &history_count)) {
+                fprintf(stderr, "ERROR: Invalid count `%s`\n", argv[1]);
+                return 1;
+            }
+        } else if (strcmp(argv[0], "-s") == 0) {
+            if (!storage.parse_profile(argv[1])) {
+                fprintf(stderr, "ERROR: Unknown storage profile `%s`\n", argv[1]);
+                return 1;
+            }
+        } else if (strcmp(argv[0], "-g") == 0) {
+            storage.database_directory = argv[1];
+        } else if (strcmp(argv[0], "-t") == 0) {
+            storage.files_directory = argv[1];
+        } else if (strcmp(argv[0], "-k") == 0) {
+            policy.keywords.push_back(argv[1]);
+        } else if (strcmp(argv[0], "-P") == 0) {
+            if (!policy.parse_chat(argv[1])) {
+                fprintf(stderr, "ERROR: Invalid policy `%s`, expected <chat-id>=<probability>[:<seconds>]\n", argv[1]);
+                return 1;
+            }
+        } else if (strcmp(argv[0], "-f") == 0) {
+            fallback_reply = argv[1];
+        } else if (strcmp(argv[0], "-F") == 0) {
+            if (!CascadeGenerator::split_args(argv[1], fallback_args) || fallback_args.empty()) {
+                fprintf(stderr, "ERROR: Invalid fallback generator `%s`\n", argv[1]);
+                return 1;
+            }
         } else {
-            assert(token.value < pairs.size());
-            render_token(pairs, pairs[token.value].l, dest);
-            render_token(pairs, pairs[token.value].r, dest);
+            usage(program);
+            fprintf(stderr, "ERROR: Unknown option %s\n", argv[0]);
+            return 1;
         }
+        argc -= 2; argv += 2;
     }
 
-    virtual bool gen_response(const std::string &, std::string &res) override
-    {
-        std::wstring wstring;
-        Token token = {(uint32_t)rand()%(uint32_t)pairs.size(), true};
-        for (std::int64_t i = 0; i < gen_limit; i++) {
-            render_token(pairs, token, wstring);
+    // The mock serves all of its chats when none are given
+    bool have_chats = argc > 0 && parse_chat_list(argv[0], chat_ids);
+    if (!have_chats) chat_ids.clear();
+    if (argc < (have_chats ? 2 : 1) || (!have_chats && !mock)) {
+        usage(program);
+        if (argc > 0 && !have_chats && !mock) fprintf(stderr, "ERROR: Invalid chat ids `%s`\n", argv[0]);
+        return 1;
+    }
+    if (have_chats) {
+        std::sort(chat_ids.begin(), chat_ids.end());
+        argc -= 1; argv += 1;
+    }
 
-            next.clear();
-            while (true) {
-                for (size_t i = 0; i < pairs.size(); i++) {
-                    if (memcmp(&pairs[i].l, &token, sizeof(token)) == 0) {
-                        next.push_back(pairs[i].r);
-                    }
-                }
-                if (next.size() > 0) break;
-                if (!token.is_node) break;
-                token = pairs[token.value].r;
-            }
+    generators_init();
+    if (!fallback_args.empty()) {
+        for (std::string &arg : fallback_args) fallback_argv.push_back(&arg[0]);
+        if (!load_generator(fallback_argv[0], &fallback)) return 1;
+        if (!fallback->parse_args(fallback_argv.size() - 1, fallback_argv.data() + 1)) return 1;
+    }
 
-            if (next.size() == 0) break;
+    // The model loads while TDLib logs in, messages wait in the queue until
+    // it's ready
+    generator_path = argv[0];
+    generator_argc = argc - 1;
+    generator_argv = argv + 1;
+    reload_start();
 
-            token = next[rand()%next.size()];
-        }
+    signal(SIGHUP, [](int) { reload_requested = 1; });
 
-        size_t res_len = wcstombs(nullptr, wstring.c_str(), 0);
-        if (res_len == (size_t)-1) {
-            fprintf(stderr, "ERROR: Could not convert some wide character\n");
-            return false;
+    // Initialize client
+    if (mock) {
+        MockTransport *mock_transport = new MockTransport{};
+        if (!mock_transport->init(mock_config)) return 1;
+        if (chat_ids.empty()) chat_ids = mock_transport->chat_ids();
+        transport = mock_transport;
+    } else {
+        storage.start();
+        td::ClientManager::execute(td_api::make_object<td_api::setLogVerbosityLevel>(1));
+        transport = new TdTransport{};
+    }
+    sender.transport = transport;
+    transport->send(sender.request_id(), td_api::make_object<td_api::getOption>("version"));
+
+    // Receive events, generate in between
+    double t_stats = now_seconds();
+    while (!transport->done() || !pending.empty() || !running.empty() || !sender.idle() || catching_up) {
+        if (reload_requested && !reloading) reload_start();
+        if (reloading && reload_done && !reload_finish()) return 1;
+        if (catching_up && catch_up_ready()) catch_up();
+        sender.flush();
+
+        bool idle = pending.empty() && running.empty();
+        bool idle_work = false;
+        if (idle && generator != nullptr) {
+            for (const Typing &t : typing) generator->prepare(t.chat_id, t.thread_id);
+            typing.clear();
+            idle_work = generator->idle();
+            if (fallback != nullptr && fallback->idle()) idle_work = true;
+            if (storage.optimize_due()) transport->send(sender.request_id(), Storage::optimize_request());
+            if (now_seconds() - t_stats >= TG_STATS_INTERVAL) {
+                generator->print_stats(stdout);
+                policy.print_stats(stdout);
+                sender.print_stats(stdout);
+                storage.print_stats(stdout);
+                if (storage.logged_in) {
+                    transport->send(sender.request_id(), td_api::make_object<td_api::getStorageStatisticsFast>());
+                }
+                t_stats = now_seconds();
+            }
         }
-        res_len += 1;
-
-        char *buffer = (char *) malloc(res_len);
-        assert(buffer != nullptr);
-        size_t len = wcstombs(buffer, wstring.c_str(), res_len);
-        if (len == (size_t)-1) {
-            fprintf(stderr, "ERROR: Could not convert some wide character\n");
-            free(buffer);
-            return false;
+        double timeout = (!idle || idle_work) && generator != nullptr ? 0.0 : reloading ? TG_RELOAD_POLL_TIME : TG_WAIT_TIME;
+        if (catching_up) timeout = std::min(timeout, TG_BACKLOG_QUIET);
+        double send_wait = sender.next_wait();
+        if (send_wait >= 0.0) timeout = std::min(timeout, send_wait);
+        // NOTE: On accounts in many busy chats the updates never stop coming,
+        // so only a batch of them is handled before generation goes on
+        auto resp = transport->receive(timeout);
+        for (std::int64_t n = 1; resp.object != nullptr; n++) {
+            if (resp.request_id == 0) {
+                n_updates += 1;
+                if (is_foreign_update(*resp.object)) n_foreign_updates += 1;
+                else process_update(std::move(resp.object));
+            } else if (!sender.handle_response(resp) && !handle_history(resp)) {
+                switch (resp.object->get_id()) {
+                case td_api::error::ID:
+                    std::cout << "ERROR: " <<
+                        static_cast<td_api::error&>(*resp.object).message_ << "\n";
+                    break;
+
+                case td_api::user::ID:
+                    user_id = static_cast<td_api::user&>(*resp.object).id_;
+                    break;
+
+                case td_api::storageStatisticsFast::ID:
+                    Storage::print_statistics(stdout, static_cast<td_api::storageStatisticsFast&>(*resp.object));
+                    break;
+                }
+            }
+            if (n == TG_RECEIVE_BATCH) break;
+            resp = transport->receive(0.0);
         }
 
-        res = std::string(buffer);
-        free(buffer);
-
-        return true;
+        update_load();
+        schedule();
+        step_running();
     }
-};
-
-// NOTE: I'm not an OOP guy. These are structures
-struct LlamaGenerator : Generator {
-    virtual bool load(const char *model_path) override
-    {
-        puts("Loading model...");
 
-        llama_log_set([](enum ggml_log_level, const char *, void *) {}, nullptr);
+    if (reloading) reload_thread.join();
+    transport->finish();
+    if (generator != nullptr) generator->print_stats(stdout);
+    policy.print_stats(stdout);
+    sender.print_stats(stdout);
+    storage.print_stats(stdout);
+    printf("Dropped %ld messages, degraded %ld replies, detected %ld repetition loops\n",
+           (long)n_shed, (long)n_degraded, (long)n_loops);
+    printf("Received %ld updates, %ld of them for chats we don't serve\n",
+           (long)n_updates, (long)n_foreign_updates);
 
-        ggml_backend_load_all();
-
-        llama_model_params model_params = llama_model_default_params();
-        model_params.n_gpu_layers = LLAMA_GPU_LAYER_COUNT;
+    return 0;
+}
 
-        model = llama_model_load_from_file(model_path, model_params);
-        if (!model) {
-            fputs("ERROR: Could not load model from file\n", stderr);
-            return false;
-        }
+static bool is_served(std::int64_t chat_id)
+{
+    return std::binary_search(chat_ids.begin(), chat_ids.end(), chat_id);
+}
 
-        vocab = llama_model_get_vocab(model);
+// Updates of the chats we are in but don't serve are most of the traffic,
+// they are dropped before any handler looks at them
+static bool is_foreign_update(const td_api::Object &u)
+{
+    switch (u.get_id()) {
+    case td_api::updateNewMessage::ID:
+        return !is_served(static_cast<const td_api::updateNewMessage &>(u).message_->chat_id_);
+    case td_api::updateMessageContent::ID:
+        return !is_served(static_cast<const td_api::updateMessageContent &>(u).chat_id_);
+    case td_api::updateDeleteMessages::ID:
+        return !is_served(static_cast<const td_api::updateDeleteMessages &>(u).chat_id_);
+    case td_api::updateChatAction::ID:
+        return !is_served(static_cast<const td_api::updateChatAction &>(u).chat_id_);
+    }
+    return false;
+}
 
-        llama_context_params ctx_params = llama_context_default_params();
-        ctx_params.n_ctx = LLAMA_CONTEXT_SIZE;
-        ctx_params.n_batch = LLAMA_CONTEXT_SIZE;
+static void process_update(td_api::object_ptr<td_api::Object> u)
+{
+    switch (u->get_id()) {
+#define X(update_type, handler) \
+        case td_api::update_type::ID: \
+            handler(td_api::move_object_as<td_api::update_type>(u)); \
+            break;
+        LIST_OF_UPDATE_HANDLERS
+#undef X
+    }
+}
 
-        ctx = llama_init_from_model(model, ctx_params);
-        if (!ctx) {
-            fputs("ERROR: Could not create context\n", stderr);
-            return false;
+static void reload_start()
+{
+    reload_requested = 0;
+    reloading = true;
+    reload_done = false;
+    t_reload_start = now_seconds();
+    printf("%s %s in the background...\n", generator == nullptr ? "Loading" : "Reloading", generator_path);
+    reload_thread = std::thread([] {
+        Generator *g = nullptr;
+        if (!load_generator(generator_path, &g) || !g->parse_args(generator_argc, generator_argv)) {
+            delete g;
+            g = nullptr;
         }
+        reloaded = g;
+        reload_done = true;
+    });
+}
 
-        smpl = llama_sampler_chain_init(llama_sampler_chain_default_params());
-        llama_sampler_chain_add(smpl, llama_sampler_init_min_p(0.05f, 1));
-        llama_sampler_chain_add(smpl, llama_sampler_init_temp(0.8f));
-        llama_sampler_chain_add(smpl, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
-
-        formatted = std::vector<char>(llama_n_ctx(ctx));
+// New requests go to the new generator right away, the old one finishes
+// its running requests and is freed when it has none. Returns false if the
+// first load failed
+static bool reload_finish()
+{
+    reload_thread.join();
+    reloading = false;
+    if (generator == nullptr) {
+        if (reloaded == nullptr) return false;
+        generator = reloaded;
+        reloaded = nullptr;
+        printf("Loaded %s in %.1f seconds, %zu messages waiting\n",
+               generator_path, now_seconds() - t_reload_start, pending.size());
+
+        for (Missed_Message &message : unobserved) {
+            if (!message.own && message.m.sender_id == user_id) message.own = true;
+            generator->observe(message.m.chat_id, message.thread_id, message.m.message_id, message.own, message.text);
+        }
+        unobserved.clear();
 
+        // The wait for the model doesn't count against the messages
+        double t = now_seconds();
+        for (Reply *r : pending) {
+            if (r->req.deadline > 0.0) r->req.deadline += t - r->t_arrival;
+            r->t_arrival = t;
+        }
         return true;
     }
-
-    virtual bool parse_args(int argc, char **argv) override
-    {
-        if (argc == 0) return true;
-        if (argc != 1) {
-            fprintf(stderr, "LLAMA ARGS: [system-message]\n");
-            return false;
-        }
-
-        printf("Pushing system message \"%s\" to model...\n", argv[0]);
-
-        messages.push_back({"system", strdup(argv[0])});
+    if (reloaded == nullptr) {
+        fputs("ERROR: Reload failed, keeping the old generator\n", stderr);
         return true;
     }
 
-    virtual bool gen_response(const std::string &input, std::string &res) override
-    {
-        const char *tmpl = llama_model_chat_template(model, nullptr);
+    Generator *old = generator;
+    generator = reloaded;
+    reloaded = nullptr;
+    old->move_idle_chats(generator);
+    draining.push_back(old);
+    drain();
+    printf("Switched to the reloaded %s\n", generator_path);
+    return true;
+}
 
-        messages.push_back({"user", strdup(input.c_str())});
-        int new_len = llama_chat_apply_template(tmpl, messages.data(), messages.size(), true, formatted.data(), formatted.size());
-        if (new_len > (int)formatted.size()) {
-            formatted.resize(new_len);
-            new_len = llama_chat_apply_template(tmpl, messages.data(), messages.size(), true, formatted.data(), formatted.size());
+// Frees the replaced generators that have nothing running anymore
+static void drain()
+{
+    for (size_t i = 0; i < draining.size();) {
+        Generator *old = draining[i];
+        old->move_idle_chats(generator);
+        bool busy = false;
+        for (Reply *r : running) {
+            if (r->generator == old) busy = true;
         }
-        if (new_len < 0) {
-            fputs("ERROR: Could not apply chat template\n", stderr);
-            return false;
+        if (busy) {
+            i++;
+            continue;
         }
+        delete old;
+        draining.erase(draining.begin() + i);
+    }
+}
 
-        std::string prompt(formatted.begin() + prev_formatted_len, formatted.begin() + new_len);
+// A replaced generator keeps the conversations it is still answering until
+// they are handed over, their messages go there and not into a new chat
+static Generator *chat_owner(std::int64_t chat_id, std::int64_t thread_id)
+{
+    for (Generator *old : draining) {
+        if (old->has_chat(chat_id, thread_id)) return old;
+    }
+    return generator;
+}
 
-        const bool is_first = llama_kv_self_used_cells(ctx) == 0;
+static const char *load_level_name(Load_Level level)
+{
+    switch (level) {
+    case LOAD_NORMAL:   return "normal";
+    case LOAD_DEGRADED: return "degraded";
+    case LOAD_SHEDDING: return "shedding";
+    }
+    return "?";
+}
 
-        const int n_prompt_tokens = -llama_tokenize(vocab, prompt.c_str(), prompt.size(), NULL, 0, is_first, true);
-        std::vector<llama_token> prompt_tokens(n_prompt_tokens);
-        if (llama_tokenize(vocab, prompt.c_str(), prompt.size(), prompt_tokens.data(), prompt_tokens.size(), is_first, true) < 0) {
-            fputs("ERROR: Could not tokenize the prompt\n", stderr);
-            return false;
-        }
+// The level the load is at when the thresholds are scaled by `k`
+static Load_Level load_level_at(size_t depth, double wait, double k)
+{
+    if (depth >= k*load_config.shed_queue || wait >= k*load_config.shed_wait) return LOAD_SHEDDING;
+    if (depth >= k*load_config.degrade_queue || wait >= k*load_config.degrade_wait) return LOAD_DEGRADED;
+    return LOAD_NORMAL;
+}
 
-        llama_batch batch = llama_batch_get_one(prompt_tokens.data(), prompt_tokens.size());
-        llama_token new_token_id;
-        printf(">> ");
-        while (true) {
-            int n_ctx = llama_n_ctx(ctx);
-            int n_ctx_used = llama_kv_self_used_cells(ctx);
-            if (n_ctx_used + batch.n_tokens > n_ctx) {
-                fputs("ERROR: Context size exceeded\n", stderr);
-                return false;
-            }
+static void update_load()
+{
+    double t = now_seconds();
+    // Messages waiting for the model to load are not late
+    bool loading = generator == nullptr;
+
+    // The level sees the queue before the messages that waited too long go
+    size_t depth = pending.size();
+    double wait = pending.empty() || loading ? 0.0 : t - pending.front()->t_arrival;
+    Load_Level level = load_level_at(depth, wait, 1.0);
+    if (level < load_level) level = std::max(level, std::min(load_level, load_level_at(depth, wait, 0.5)));
+    if (level != load_level) {
+        printf("Load: %s (%zu waiting, oldest for %.1fs)\n", load_level_name(level), depth, wait);
+        load_level = level;
+    }
 
-            if (llama_decode(ctx, batch)) {
-                fputs("ERROR: Could not decode\n", stderr);
-                return false;
-            }
+    // Nobody waits for a reply that late anymore
+    while (!loading && !pending.empty() && t - pending.front()->t_arrival >= load_config.shed_wait) {
+        delete pending.front();
+        pending.pop_front();
+        n_shed += 1;
+    }
+}
 
-            new_token_id = llama_sampler_sample(smpl, ctx, -1);
+static size_t count_running(Generator *g)
+{
+    size_t n = 0;
+    for (Reply *r : running) {
+        if (r->generator == g) n++;
+    }
+    return n;
+}
 
-            if (llama_vocab_is_eog(vocab, new_token_id)) {
-                break;
-            }
+// Threads of a chat are separate conversations and may run at the same time
+static bool chat_is_running(const Gen_Request &req)
+{
+    for (Reply *r : running) {
+        if (r->req.chat_id == req.chat_id && r->req.thread_id == req.thread_id) return true;
+    }
+    return false;
+}
 
-            char buf[256];
-            int n = llama_token_to_piece(vocab, new_token_id, buf, sizeof(buf), 0, true);
-            if (n < 0) {
-                fputs("ERROR: Could not convert token to piece\n", stderr);
-                return false;
-            }
+static void admit(Reply *r, Generator *g)
+{
+    if (load_level != LOAD_NORMAL) {
+        if (r->req.max_tokens == 0 || r->req.max_tokens > load_config.degraded_max_tokens) {
+            r->req.max_tokens = load_config.degraded_max_tokens;
+        }
+        n_degraded += 1;
+    }
 
-            printf("%.*s", n, buf);
-            fflush(stdout);
+    r->generator = g;
+    if (!g->begin(r->req)) {
+        send_reply(r);
+        return;
+    }
+    running.push_back(r);
+}
 
-            res.append(buf, n);
+// Admits waiting messages in arrival order. Chats with the same batch group
+// are generated together; a message of another group only waits for the
+// running group up to SCHED_GROUP_HOLD
+static void schedule()
+{
+    if (pending.empty() || generator == nullptr) return;
 
-            batch = llama_batch_get_one(&new_token_id, 1);
+    Reply *first = pending.front();
+    for (Reply *r : running) {
+        if (r->generator == generator) first = r;
+    }
+    int group = generator->batch_group(first->req.chat_id);
+    double t = now_seconds();
+    size_t n_running = count_running(generator);
+    for (auto it = pending.begin(); it != pending.end() && n_running < generator->max_batch();) {
+        Reply *r = *it;
+        if (generator->batch_group(r->req.chat_id) != group) {
+            if (t - r->t_arrival > SCHED_GROUP_HOLD) break;
+            ++it;
+            continue;
+        }
+        // One message per conversation at a time, the next one sees the reply
+        if (chat_is_running(r->req)) {
+            ++it;
+            continue;
         }
 
-        putchar('\n');
+        it = pending.erase(it);
+        admit(r, generator);
+        n_running += 1;
+    }
+
+    if (load_level == LOAD_NORMAL || fallback == nullptr) return;
 
-        messages.push_back({"assistant", strdup(res.c_str())});
-        prev_formatted_len = llama_chat_apply_template(tmpl, messages.data(), messages.size(), false, nullptr, 0);
-        if (prev_formatted_len < 0) {
-            fputs("ERROR: Could not apply chat template\n", stderr);
-            return false;
+    // The overflow, oldest first
+    n_running = count_running(fallback);
+    for (auto it = pending.begin(); it != pending.end() && n_running < fallback->max_batch();) {
+        Reply *r = *it;
+        if (chat_is_running(r->req)) {
+            ++it;
+            continue;
         }
+        it = pending.erase(it);
+        admit(r, fallback);
+        n_running += 1;
+    }
+}
 
-        return true;
+static void step_running()
+{
+    if (running.empty()) return;
+
+    running_reqs.clear();
+    for (Reply *r : running) {
+        if (r->generator == generator) running_reqs.push_back(&r->req);
+    }
+    if (!running_reqs.empty()) generator->step_batch(running_reqs.data(), running_reqs.size());
+
+    for (size_t i = 0; i <= draining.size(); i++) {
+        Generator *other = i < draining.size() ? draining[i] : fallback;
+        if (other == nullptr) continue;
+        running_reqs.clear();
+        for (Reply *r : running) {
+            if (r->generator == other) running_reqs.push_back(&r->req);
+        }
+        if (!running_reqs.empty()) other->step_batch(running_reqs.data(), running_reqs.size());
     }
-};
 
-static void auth_state_wait_code(td_api::object_ptr<td_api::authorizationStateWaitCode>);
-static void auth_state_wait_phone_number(td_api::object_ptr<td_api::authorizationStateWaitPhoneNumber>);
-static void auth_state_ready(td_api::object_ptr<td_api::authorizationStateReady>);
-static void auth_state_wait_tdlib_params(td_api::object_ptr<td_api::authorizationStateWaitTdlibParameters>);
-static void update_auth_state(td_api::object_ptr<td_api::updateAuthorizationState>);
-static void update_new_message(td_api::object_ptr<td_api::updateNewMessage>);
+    bool drained = false;
+    for (size_t i = 0; i < running.size();) {
+        if (running[i]->req.status == GEN_RUNNING) {
+            i++;
+            continue;
+        }
+        if (running[i]->generator != generator && running[i]->generator != fallback) drained = true;
+        send_reply(running[i]);
+        running.erase(running.begin() + i);
+    }
+    if (drained) drain();
+}
 
-static void process_update(td_api::object_ptr<td_api::Object> u);
-static bool load_generator(const char *file_path, Generator **res);
+static void send_reply(Reply *r)
+{
+    n_loops += r->req.stats.n_loops;
 
-static td::ClientManager manager;
-static std::int32_t      client_id;
-static std::int64_t      chat_id;
-static std::int64_t      user_id;
+    if (r->req.status != GEN_ERROR && !r->req.response.empty()) {
+        printf("[%ld] >> %s\n", (long)r->req.chat_id, r->req.response.c_str());
+        sender.send_message(r->req.chat_id, r->req.thread_id, r->message_id, std::move(r->req.response));
+    } else {
+        sender.send_message(r->req.chat_id, r->req.thread_id, r->message_id, fallback_reply);
+    }
 
-// NOTE: One-off leak
-static Generator *generator;
+    delete r;
+}
 
-int main(int argc, char **argv)
+// Who sent the message and to whom, the text is set by the caller
+static Policy_Message policy_message(const td_api::message &message)
 {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <chat-id> <generator> [GENERATOR ARGS]\n", argv[0]);
-        return 1;
+    Policy_Message m = {};
+    m.chat_id = message.chat_id_;
+    m.message_id = message.id_;
+    if (message.sender_id_->get_id() == td_api::messageSenderUser::ID) {
+        m.sender_id = static_cast<const td_api::messageSenderUser&>(*message.sender_id_).user_id_;
+        m.from_user = true;
+    } else if (message.sender_id_->get_id() == td_api::messageSenderChat::ID) {
+        m.sender_id = static_cast<const td_api::messageSenderChat&>(*message.sender_id_).chat_id_;
+    }
+    if (message.reply_to_ != nullptr && message.reply_to_->get_id() == td_api::messageReplyToMessage::ID) {
+        auto &reply_to = static_cast<const td_api::messageReplyToMessage &>(*message.reply_to_);
+        if (reply_to.chat_id_ == message.chat_id_) m.reply_to_id = reply_to.message_id_;
     }
+    m.mentioned = message.contains_unread_mention_;
+    return m;
+}
 
-    if (!str_to_int64(argv[1], strlen(argv[1]), &chat_id)) return 1;
+static void update_new_message(td_api::object_ptr<td_api::updateNewMessage> u)
+{
+    td_api::message &message = *u->message_;
+    if (message.content_->get_id() != td_api::messageText::ID) return;
+    const std::string &text = static_cast<td_api::messageText &>(*message.content_).text_->text_;
+
+    Policy_Message m = policy_message(message);
+    bool own = m.sender_id == user_id;
+
+    // Our replies are in the history already, they are still being sent
+    if (own && message.sending_state_ != nullptr) return;
+
+    // Missed messages are kept for the catch-up, and so are the later ones of
+    // their chats and the ones of chats whose history is being fetched to
+    // stay in order
+    bool missed = message.date_ < t_process_start;
+    for (size_t i = 0; i < backlog.size() && !missed; i++) {
+        if (backlog[i].m.chat_id == message.chat_id_) missed = true;
+    }
+    for (size_t i = 0; i < history_fetches.size() && !missed; i++) {
+        if (history_fetches[i].chat_id == message.chat_id_) missed = true;
+    }
+    if (missed) {
+        backlog.push_back({m, message.message_thread_id_, own, text});
+        if (message.date_ < t_process_start) t_last_missed = now_seconds();
+        if (own) policy.add_own(message.chat_id_, message.id_);
+        catching_up = true;
+        return;
+    }
 
-    if (!load_generator(argv[2], &generator)) return 1;
-    if (!generator->parse_args(argc-3, argv+3)) return 1;
+    if (observe && generator == nullptr) {
+        unobserved.push_back({m, message.message_thread_id_, own, text});
+    } else if (observe) {
+        Generator *g = chat_owner(message.chat_id_, message.message_thread_id_);
+        g->observe(message.chat_id_, message.message_thread_id_, message.id_, own, text);
+    }
+    if (own) {
+        policy.add_own(message.chat_id_, message.id_);
+        return;
+    }
 
-    // Initialize client
-    td::ClientManager::execute(td_api::make_object<td_api::setLogVerbosityLevel>(1));
-    client_id = manager.create_client_id();
-    manager.send(client_id, 1, td_api::make_object<td_api::getOption>("version"));
+    m.text = text.c_str();
+    Policy_Decision d = policy.decide(m);
+    if (d > POLICY_CHANCE) return;
+    queue_reply(message.chat_id_, message.id_, message.message_thread_id_, text, d != POLICY_CHANCE);
+}
 
-    // Receive events
-    while (true) {
-        auto resp = manager.receive(TG_WAIT_TIME);
-        if (resp.object == nullptr) continue;
+static void queue_reply(std::int64_t chat_id, std::int64_t message_id, std::int64_t thread_id, const std::string &text,
+                        bool addressed)
+{
+    if (load_level == LOAD_SHEDDING) {
+        n_shed += 1;
+        return;
+    }
 
-        if (resp.request_id == 0) {
-            process_update(std::move(resp.object));
-        } else {
-            switch (resp.object->get_id()) {
-            case td_api::error::ID:
-                std::cout << "ERROR: " <<
-                    static_cast<td_api::error&>(*resp.object).message_ << "\n";
-                break;
-
-            case td_api::user::ID:
-                user_id = static_cast<td_api::user&>(*resp.object).id_;
-                break;
-            }
-        }
+    Reply *r = new Reply{};
+    r->message_id = message_id;
+    r->t_arrival = now_seconds();
+    r->req.chat_id = chat_id;
+    r->req.message_id = message_id;
+    r->req.thread_id = thread_id;
+    r->req.input = text;
+    r->req.addressed = addressed;
+
+    Budget budget = default_budget;
+    for (const Budget &b : chat_budgets) {
+        if (b.chat_id == r->req.chat_id) budget = b;
     }
+    r->req.max_tokens = budget.max_tokens;
+    if (budget.seconds > 0.0) r->req.deadline = r->t_arrival + budget.seconds;
+    pending.push_back(r);
+}
 
-    return 0;
+// Everything from before the start is in once the generator is loaded, the
+// histories are fetched and missed messages stopped coming
+static bool catch_up_ready()
+{
+    if (generator == nullptr || now_seconds() - t_last_missed < TG_BACKLOG_QUIET) return false;
+    for (const History_Fetch &f : history_fetches) {
+        if (!f.done) return false;
+    }
+    return true;
 }
 
-static bool load_generator(const char *file_path, Generator **res)
+// The fetched histories go first, oldest first and per thread. Everything
+// missed follows without a reply, then every chat gets at most one reply: to
+// its last message addressed to us, or else to its last message
+static void catch_up()
 {
-    // Get extension
-    size_t len = strlen(file_path);
-    const char *extension = &file_path[len-1];
-    while (*extension != '.') {
-        if (extension == file_path) {
-            fprintf(stderr, "ERROR: Could not identify the generator: filename doesn't have an extension\n");
-            return false;
+    catching_up = false;
+
+    std::int64_t n_backfilled = 0;
+    for (History_Fetch &f : history_fetches) {
+        std::unordered_map<std::int64_t, std::vector<Gen_Message>> threads;
+        std::vector<std::int64_t> thread_ids;
+        for (size_t i = f.messages.size(); i-- > 0;) {
+            const Missed_Message &message = f.messages[i];
+            bool in_backlog = false;
+            for (const Missed_Message &missed : backlog) {
+                if (missed.m.chat_id == f.chat_id && missed.m.message_id == message.m.message_id) in_backlog = true;
+            }
+            if (in_backlog) continue;
+
+            if (threads.find(message.thread_id) == threads.end()) thread_ids.push_back(message.thread_id);
+            threads[message.thread_id].push_back({message.m.message_id, message.m.sender_id == user_id, message.text});
+            n_backfilled += 1;
+        }
+        for (std::int64_t thread_id : thread_ids) {
+            chat_owner(f.chat_id, thread_id)->backfill(f.chat_id, thread_id, threads[thread_id]);
+        }
+    }
+    history_fetches.clear();
+    if (n_backfilled > 0) printf("Fetched %ld messages of history\n", (long)n_backfilled);
+    if (backlog.empty()) return;
+
+    std::unordered_map<std::int64_t, size_t> chosen; // by chat
+    std::vector<std::int64_t> chats;
+    for (size_t i = 0; i < backlog.size(); i++) {
+        Missed_Message &missed = backlog[i];
+        // The user might not have been known when it came
+        if (!missed.own && missed.m.sender_id == user_id) {
+            missed.own = true;
+            policy.add_own(missed.m.chat_id, missed.m.message_id);
+        }
+        chat_owner(missed.m.chat_id, missed.thread_id)->observe(missed.m.chat_id, missed.thread_id, missed.m.message_id,
+                                                                 missed.own, missed.text);
+        if (missed.own) continue;
+
+        auto it = chosen.find(missed.m.chat_id);
+        if (it == chosen.end()) {
+            chosen[missed.m.chat_id] = i;
+            chats.push_back(missed.m.chat_id);
+        } else if (policy.is_addressed(missed.m) || !policy.is_addressed(backlog[it->second].m)) {
+            it->second = i;
         }
-        extension -= 1;
     }
 
-    if (strcmp(extension, ".gguf") == 0) {
-        *res = new LlamaGenerator{};
-    } else if (strcmp(extension, ".bpe") == 0) {
-        *res = new BpeGenerator{};
-    } else {
-        fprintf(stderr, "ERROR: Unknown generator type `%s`\n", extension);
-        return false;
+    std::int64_t n_replies = 0;
+    for (std::int64_t chat_id : chats) {
+        const Missed_Message &missed = backlog[chosen[chat_id]];
+        Policy_Message m = missed.m;
+        m.text = missed.text.c_str();
+        Policy_Decision d = policy.decide(m);
+        if (d > POLICY_CHANCE) continue;
+        queue_reply(m.chat_id, m.message_id, missed.thread_id, missed.text, d != POLICY_CHANCE);
+        n_replies += 1;
     }
 
-    return (*res)->load(file_path);
+    printf("Caught up on %zu messages, replying to %ld of them\n", backlog.size(), (long)n_replies);
+    backlog.clear();
 }
 
-static void process_update(td_api::object_ptr<td_api::Object> u)
+static void update_message_content(td_api::object_ptr<td_api::updateMessageContent> u)
 {
-    switch (u->get_id()) {
-#define X(update_type, handler) \
-        case td_api::update_type::ID: \
-            handler(td_api::move_object_as<td_api::update_type>(u)); \
-            break;
-        LIST_OF_UPDATE_HANDLERS
-#undef X
+    if (u->new_content_->get_id() != td_api::messageText::ID) return;
+    const std::string &text = static_cast<td_api::messageText &>(*u->new_content_).text_->text_;
+
+    // Not answered yet, the reply will see the new text
+    for (Reply *r : pending) {
+        if (r->req.chat_id == u->chat_id_ && r->message_id == u->message_id_) r->req.input = text;
     }
+    for (Missed_Message &missed : backlog) {
+        if (missed.m.chat_id == u->chat_id_ && missed.m.message_id == u->message_id_) missed.text = text;
+    }
+    for (Missed_Message &message : unobserved) {
+        if (message.m.chat_id == u->chat_id_ && message.m.message_id == u->message_id_) message.text = text;
+    }
+
+    if (generator != nullptr) generator->edit_message(u->chat_id_, u->message_id_, text);
+    for (Generator *old : draining) old->edit_message(u->chat_id_, u->message_id_, text);
+    if (fallback != nullptr) fallback->edit_message(u->chat_id_, u->message_id_, text);
 }
 
-static bool str_to_int64(const char *str, size_t len, std::int64_t *res)
+static void update_delete_messages(td_api::object_ptr<td_api::updateDeleteMessages> u)
 {
-    *res = 0;
-    for (size_t i = 0; i < len; i++) {
-        if (!isdigit(str[i])) return false;
-        *res = *res*10 + (str[i]-'0');
+    // Messages only dropped from the TDLib cache are still in the chat
+    if (!u->is_permanent_ || u->from_cache_) return;
+
+    for (std::int64_t message_id : u->message_ids_) {
+        auto it = std::find_if(pending.begin(), pending.end(), [&](Reply *r) {
+            return r->req.chat_id == u->chat_id_ && r->message_id == message_id;
+        });
+        if (it != pending.end()) {
+            delete *it;
+            pending.erase(it);
+        }
+        auto is_deleted = [&](const Missed_Message &missed) {
+            return missed.m.chat_id == u->chat_id_ && missed.m.message_id == message_id;
+        };
+        backlog.erase(std::remove_if(backlog.begin(), backlog.end(), is_deleted), backlog.end());
+        unobserved.erase(std::remove_if(unobserved.begin(), unobserved.end(), is_deleted), unobserved.end());
+
+        if (generator != nullptr) generator->delete_message(u->chat_id_, message_id);
+        for (Generator *old : draining) old->delete_message(u->chat_id_, message_id);
+        if (fallback != nullptr) fallback->delete_message(u->chat_id_, message_id);
     }
-
-    return true;
 }
 
-static void update_new_message(td_api::object_ptr<td_api::updateNewMessage> u)
+static void update_chat_action(td_api::object_ptr<td_api::updateChatAction> u)
 {
-    if (u->message_->chat_id_ != chat_id) return;
-    if (u->message_->sender_id_->get_id() == td_api::messageSenderUser::ID) {
-        if (static_cast<td_api::messageSenderUser&>(*u->message_->sender_id_).user_id_ == user_id)
+    if (u->action_->get_id() != td_api::chatActionTyping::ID) return;
+    if (u->sender_id_->get_id() == td_api::messageSenderUser::ID) {
+        if (static_cast<td_api::messageSenderUser&>(*u->sender_id_).user_id_ == user_id)
             return;
     }
 
-    if (u->message_->content_->get_id() == td_api::messageText::ID) {
-        auto send_message = td_api::make_object<td_api::sendMessage>();
-        send_message->chat_id_ = chat_id;
-        auto message_content = td_api::make_object<td_api::inputMessageText>();
-        send_message->reply_to_ =
-            td_api::make_object<td_api::inputMessageReplyToMessage>(
-                    u->message_->id_, nullptr);
-
-        // manager.send(client_id, 1,
-        //         td_api::make_object<td_api::sendChatAction>(chat_id, 0, nullptr,
-        //             td_api::make_object<td_api::chatActionTyping>()));
-
-        std::string resp;
-        message_content->text_ = td_api::make_object<td_api::formattedText>();
-        if (generator->gen_response(static_cast<td_api::messageText &>(*u->message_->content_).text_->text_, resp)) {
-            message_content->text_->text_ = std::move(resp);
-        } else {
-            message_content->text_->text_ = "Sorry, something went wrong";
-        }
+    for (const Typing &t : typing) {
+        if (t.chat_id == u->chat_id_ && t.thread_id == u->message_thread_id_) return;
+    }
+    typing.push_back({u->chat_id_, u->message_thread_id_});
+}
 
-        // manager.send(client_id, 1,
-        //         td_api::make_object<td_api::sendChatAction>(chat_id, 0, nullptr,
-        //             td_api::make_object<td_api::chatActionCancel>()));
+static void update_message_send_succeeded(td_api::object_ptr<td_api::updateMessageSendSucceeded> u)
+{
+    policy.add_own(u->message_->chat_id_, u->message_->id_);
+    sender.send_succeeded(u->old_message_id_);
+}
 
-        send_message->input_message_content_ = std::move(message_content);
-        manager.send(client_id, 1, std::move(send_message));
-    }
+static void update_message_send_failed(td_api::object_ptr<td_api::updateMessageSendFailed> u)
+{
+    sender.send_failed(u->old_message_id_, *u->error_);
 }
 
 static void update_auth_state(td_api::object_ptr<td_api::updateAuthorizationState> u)
@@ -443,10 +1083,7 @@ static void auth_state_wait_tdlib_params(td_api::object_ptr<td_api::authorizatio
 {
     auto params = td_api::make_object<td_api::setTdlibParameters>();
     params->use_test_dc_ = false;
-    params->database_directory_ = "data";
-    params->use_file_database_ = true;
-    params->use_chat_info_database_ = true;
-    params->use_message_database_ = true;
+    storage.set_parameters(*params);
     params->use_secret_chats_ = false;
     params->api_id_ = TG_API_ID;
     params->api_hash_ = TG_API_HASH;
@@ -455,7 +1092,7 @@ static void auth_state_wait_tdlib_params(td_api::object_ptr<td_api::authorizatio
     params->system_version_ = "Debian 12";
     params->application_version_ = "0.1";
     puts("Sending tdlib parameters...");
-    manager.send(client_id, 1, td_api::move_object_as<td_api::Function>(params));
+    transport->send(sender.request_id(), td_api::move_object_as<td_api::Function>(params));
 }
 
 static void auth_state_wait_phone_number(td_api::object_ptr<td_api::authorizationStateWaitPhoneNumber>)
@@ -464,7 +1101,7 @@ static void auth_state_wait_phone_number(td_api::object_ptr<td_api::authorizatio
     printf("Phone number: ");
     std::getline(std::cin, input);
     puts("Sending phone number...");
-    manager.send(client_id, 1, td_api::make_object<td_api::setAuthenticationPhoneNumber>(input, nullptr));
+    transport->send(sender.request_id(), td_api::make_object<td_api::setAuthenticationPhoneNumber>(input, nullptr));
 }
 
 static void auth_state_wait_code(td_api::object_ptr<td_api::authorizationStateWaitCode>)
@@ -473,13 +1110,73 @@ static void auth_state_wait_code(td_api::object_ptr<td_api::authorizationStateWa
     printf("Code: ");
     std::getline(std::cin, input);
     puts("Sending code...");
-    manager.send(client_id, 1, td_api::make_object<td_api::checkAuthenticationCode>(input));
+    transport->send(sender.request_id(), td_api::make_object<td_api::checkAuthenticationCode>(input));
 }
 
 static void auth_state_ready(td_api::object_ptr<td_api::authorizationStateReady>)
 {
     puts("Succesful login");
-    manager.send(client_id, 1, td_api::make_object<td_api::getMe>());
+    storage.login();
+    transport->send(sender.request_id(), td_api::make_object<td_api::getMe>());
+
+    if (history_count <= 0 || history_requested) return;
+    history_requested = true;
+    for (std::int64_t chat_id : chat_ids) {
+        history_fetches.push_back({chat_id, 0, 0, {}, false});
+        request_history(history_fetches.size() - 1);
+    }
+    catching_up = true;
+}
+
+static void request_history(size_t i)
+{
+    const History_Fetch &f = history_fetches[i];
+    std::uint64_t id = sender.request_id();
+    std::int32_t limit = (std::int32_t)std::min<std::int64_t>(TG_HISTORY_PAGE, history_count - f.n_fetched);
+    transport->send(id, td_api::make_object<td_api::getChatHistory>(f.chat_id, f.from_message_id, 0, limit, false));
+    history_requests[id] = i;
+}
+
+// Returns false if the response is not for a history page
+static bool handle_history(td::ClientManager::Response &resp)
+{
+    auto it = history_requests.find(resp.request_id);
+    if (it == history_requests.end()) return false;
+    History_Fetch &f = history_fetches[it->second];
+    size_t i = it->second;
+    history_requests.erase(it);
+
+    if (resp.object->get_id() != td_api::messages::ID) {
+        if (resp.object->get_id() == td_api::error::ID) {
+            fprintf(stderr, "ERROR: Could not fetch the history of chat %ld: %s\n", (long)f.chat_id,
+                    static_cast<td_api::error &>(*resp.object).message_.c_str());
+        }
+        f.done = true;
+        return true;
+    }
+
+    // Pages may overlap at the message they start from
+    std::int64_t from_message_id = f.from_message_id;
+    for (auto &message : static_cast<td_api::messages &>(*resp.object).messages_) {
+        if (message == nullptr || (f.from_message_id != 0 && message->id_ >= f.from_message_id)) continue;
+        f.n_fetched += 1;
+        from_message_id = message->id_;
+        if (message->content_->get_id() != td_api::messageText::ID) continue;
+
+        Missed_Message missed = {};
+        missed.m = policy_message(*message);
+        missed.thread_id = message->message_thread_id_;
+        missed.text = static_cast<td_api::messageText &>(*message->content_).text_->text_;
+        f.messages.push_back(std::move(missed));
+    }
+
+    if (from_message_id == f.from_message_id || f.n_fetched >= history_count) {
+        f.done = true;
+        return true;
+    }
+    f.from_message_id = from_message_id;
+    request_history(i);
+    return true;
 }
 
 // TODO: Better reporting
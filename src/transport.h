@@ -0,0 +1,353 @@
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+// Where updates come from and where requests go. `TdTransport` talks to
+// Telegram through TDLib, `MockTransport` synthesizes traffic offline so the
+// whole pipeline can be load-tested without an account.
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <td/telegram/Client.h>
+
+#include "common.h"
+#include "json.h"
+
+#define MOCK_USER_ID          1
+#define MOCK_FIRST_SENDER_ID  1000
+#define MOCK_SENDER_COUNT     64
+#define MOCK_SEED             1337
+#define MOCK_BURST_SPACING    0.05 // seconds between messages of one burst
+#define MOCK_DEFAULT_RECORD   "mock-sent.jsonl"
+
+struct Transport {
+    virtual void send(td::ClientManager::RequestId request_id, td::td_api::object_ptr<td::td_api::Function> request) = 0;
+    virtual td::ClientManager::Response receive(double timeout) = 0;
+
+    // The transport won't deliver anything anymore
+    virtual bool done() { return false; }
+    virtual void finish() {}
+};
+
+struct TdTransport : Transport {
+    td::ClientManager manager;
+    td::ClientManager::ClientId client_id;
+
+    TdTransport()
+    {
+        client_id = manager.create_client_id();
+    }
+
+    virtual void send(td::ClientManager::RequestId request_id, td::td_api::object_ptr<td::td_api::Function> request) override
+    {
+        manager.send(client_id, request_id, std::move(request));
+    }
+
+    virtual td::ClientManager::Response receive(double timeout) override
+    {
+        return manager.receive(timeout);
+    }
+};
+
+enum Mock_Arrivals {
+    MOCK_ARRIVALS_POISSON,
+    MOCK_ARRIVALS_BURSTY,
+    MOCK_ARRIVALS_REPLAY,
+};
+
+struct Mock_Config {
+    Mock_Arrivals arrivals;
+    double rate;                 // messages per second over all chats
+    std::int64_t burst;          // messages per burst
+    const char *replay_path;     // JSONL: {"t": <seconds>, "chat": <id>, "text": "..."}
+    const char *texts_path;      // one message text per line, optional
+    const char *record_path;
+    std::int64_t chat_count;
+    std::int64_t message_count;
+};
+
+static inline bool json_parse_double(const char *p, double *res)
+{
+    char *end;
+    *res = strtod(p, &end);
+    return end != p;
+}
+
+// `poisson:<rate>`, `bursty:<rate>:<burst>` or `replay:<file>`
+static inline bool mock_parse_arrivals(const char *spec, Mock_Config *config)
+{
+    const char *arg = strchr(spec, ':');
+    if (arg == nullptr) {
+        fprintf(stderr, "ERROR: Invalid mock arrivals `%s`\n", spec);
+        return false;
+    }
+    arg += 1;
+
+    char *end;
+    if (strncmp(spec, "poisson:", arg - spec) == 0) {
+        config->arrivals = MOCK_ARRIVALS_POISSON;
+        config->rate = strtod(arg, &end);
+        if (end == arg || *end != '\0' || config->rate <= 0.0) {
+            fprintf(stderr, "ERROR: Invalid mock arrival rate `%s`\n", arg);
+            return false;
+        }
+    } else if (strncmp(spec, "bursty:", arg - spec) == 0) {
+        config->arrivals = MOCK_ARRIVALS_BURSTY;
+        config->rate = strtod(arg, &end);
+        if (end == arg || *end != ':' || config->rate <= 0.0) {
+            fprintf(stderr, "ERROR: Invalid mock arrival rate `%s`\n", arg);
+            return false;
+        }
+        if (!str_to_int64(end + 1, strlen(end + 1), &config->burst) || config->burst == 0) {
+            fprintf(stderr, "ERROR: Invalid mock burst size `%s`\n", end + 1);
+            return false;
+        }
+    } else if (strncmp(spec, "replay:", arg - spec) == 0) {
+        config->arrivals = MOCK_ARRIVALS_REPLAY;
+        config->replay_path = arg;
+    } else {
+        fprintf(stderr, "ERROR: Unknown mock arrivals `%.*s`\n", (int)(arg - spec - 1), spec);
+        return false;
+    }
+
+    return true;
+}
+
+struct MockTransport : Transport {
+    struct Arrival {
+        double t; // seconds since the start
+        std::int64_t chat_id;
+        std::string text;
+    };
+
+    Mock_Config config;
+    std::vector<Arrival> arrivals;
+    size_t next_arrival = 0;
+    std::deque<td::ClientManager::Response> responses;
+    std::unordered_map<std::int64_t, double> arrival_times; // message id -> t
+    std::int64_t next_message_id = 1;
+    std::mt19937 rng;
+    FILE *record = nullptr;
+    double t_start;
+
+    std::vector<double> latencies;
+
+    bool init(const Mock_Config &c)
+    {
+        config = c;
+        rng.seed(MOCK_SEED);
+
+        std::vector<std::string> texts;
+        if (config.texts_path != nullptr) {
+            std::ifstream ifs(config.texts_path);
+            if (!ifs.good()) {
+                fprintf(stderr, "ERROR: Could not open file '%s'\n", config.texts_path);
+                return false;
+            }
+            std::string line;
+            while (std::getline(ifs, line)) {
+                if (!line.empty()) texts.push_back(line);
+            }
+        }
+
+        switch (config.arrivals) {
+        case MOCK_ARRIVALS_POISSON:
+        case MOCK_ARRIVALS_BURSTY: {
+            std::int64_t burst = config.arrivals == MOCK_ARRIVALS_BURSTY ? config.burst : 1;
+            std::exponential_distribution<double> gap(config.rate/burst);
+            std::uniform_int_distribution<std::int64_t> chat(1, config.chat_count);
+            double t = 0.0;
+            while ((std::int64_t)arrivals.size() < config.message_count) {
+                t += gap(rng);
+                std::int64_t chat_id = chat(rng);
+                for (std::int64_t i = 0; i < burst && (std::int64_t)arrivals.size() < config.message_count; i++) {
+                    size_t n = arrivals.size();
+                    std::string text = texts.empty() ? "message #" + std::to_string(n) : texts[n%texts.size()];
+                    arrivals.push_back({t + i*MOCK_BURST_SPACING, chat_id, std::move(text)});
+                }
+            }
+        } break;
+
+        case MOCK_ARRIVALS_REPLAY: {
+            std::ifstream ifs(config.replay_path);
+            if (!ifs.good()) {
+                fprintf(stderr, "ERROR: Could not open file '%s'\n", config.replay_path);
+                return false;
+            }
+
+            size_t line_number = 0;
+            std::string line;
+            while (std::getline(ifs, line)) {
+                line_number += 1;
+                if (line.empty()) continue;
+
+                Arrival a = {};
+                const char *t = json_find_value(line, "t");
+                const char *chat = json_find_value(line, "chat");
+                const char *text = json_find_value(line, "text");
+                std::string chat_str;
+                if (t == nullptr || !json_parse_double(t, &a.t) ||
+                    chat == nullptr || !json_parse_scalar(chat, chat_str) ||
+                    !parse_chat_id(chat_str.c_str(), chat_str.size(), &a.chat_id) ||
+                    text == nullptr || !json_parse_string(text, a.text)) {
+                    fprintf(stderr, "%s:%zu: ERROR: Expected {\"t\": <seconds>, \"chat\": <id>, \"text\": \"...\"}\n",
+                            config.replay_path, line_number);
+                    return false;
+                }
+                arrivals.push_back(std::move(a));
+            }
+
+            std::stable_sort(arrivals.begin(), arrivals.end(),
+                             [](const Arrival &a, const Arrival &b) { return a.t < b.t; });
+        } break;
+        }
+
+        record = fopen(config.record_path, "w");
+        if (record == nullptr) {
+            fprintf(stderr, "ERROR: Could not open file %s for writing: %s\n", config.record_path, strerror(errno));
+            return false;
+        }
+
+        printf("Mock: %zu messages over %.1fs\n", arrivals.size(), arrivals.empty() ? 0.0 : arrivals.back().t);
+
+        // We start already logged in
+        respond(0, td::td_api::make_object<td::td_api::updateAuthorizationState>(
+                    td::td_api::make_object<td::td_api::authorizationStateReady>()));
+
+        t_start = now_seconds();
+        return true;
+    }
+
+    // Every chat the messages go to, sorted
+    std::vector<std::int64_t> chat_ids() const
+    {
+        std::vector<std::int64_t> ids;
+        for (const Arrival &a : arrivals) ids.push_back(a.chat_id);
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+        return ids;
+    }
+
+    void respond(td::ClientManager::RequestId request_id, td::td_api::object_ptr<td::td_api::Object> object)
+    {
+        responses.push_back({0, request_id, std::move(object)});
+    }
+
+    virtual void send(td::ClientManager::RequestId request_id, td::td_api::object_ptr<td::td_api::Function> request) override
+    {
+        switch (request->get_id()) {
+        case td::td_api::getMe::ID: {
+            auto me = td::td_api::make_object<td::td_api::user>();
+            me->id_ = MOCK_USER_ID;
+            respond(request_id, std::move(me));
+        } break;
+
+        case td::td_api::sendMessage::ID: {
+            auto &send_message = static_cast<td::td_api::sendMessage &>(*request);
+            double t = now_seconds() - t_start;
+
+            std::int64_t reply_to = 0;
+            if (send_message.reply_to_ != nullptr &&
+                send_message.reply_to_->get_id() == td::td_api::inputMessageReplyToMessage::ID) {
+                reply_to = static_cast<td::td_api::inputMessageReplyToMessage &>(*send_message.reply_to_).message_id_;
+            }
+
+            std::string text;
+            if (send_message.input_message_content_ != nullptr &&
+                send_message.input_message_content_->get_id() == td::td_api::inputMessageText::ID) {
+                text = static_cast<td::td_api::inputMessageText &>(*send_message.input_message_content_).text_->text_;
+            }
+
+            double latency = -1.0;
+            auto it = arrival_times.find(reply_to);
+            if (it != arrival_times.end()) {
+                latency = t - it->second;
+                latencies.push_back(latency);
+            }
+
+            fprintf(record, "{\"t_ms\": %.3f, \"chat\": %ld, \"reply_to\": %ld, \"latency_ms\": %.3f, \"text\": ",
+                    t*1000.0, (long)send_message.chat_id_, (long)reply_to, latency*1000.0);
+            print_json_string(record, text.c_str());
+            fprintf(record, "}\n");
+
+            auto message = td::td_api::make_object<td::td_api::message>();
+            message->id_ = next_message_id++;
+            message->chat_id_ = send_message.chat_id_;
+            message->is_outgoing_ = true;
+            respond(request_id, std::move(message));
+        } break;
+
+        // The chats start empty
+        case td::td_api::getChatHistory::ID:
+            respond(request_id, td::td_api::make_object<td::td_api::messages>());
+            break;
+
+        default:
+            respond(request_id, td::td_api::make_object<td::td_api::ok>());
+            break;
+        }
+    }
+
+    virtual td::ClientManager::Response receive(double timeout) override
+    {
+        // Waits like TDLib does: until the next message, at most `timeout`
+        if (responses.empty()) {
+            double wait = timeout;
+            if (next_arrival < arrivals.size()) wait = std::min(wait, arrivals[next_arrival].t - (now_seconds() - t_start));
+            if (wait > 0.0) std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+        }
+
+        if (responses.empty() && next_arrival < arrivals.size() && arrivals[next_arrival].t <= now_seconds() - t_start) {
+            const Arrival &a = arrivals[next_arrival];
+            auto message = td::td_api::make_object<td::td_api::message>();
+            message->id_ = next_message_id++;
+            message->chat_id_ = a.chat_id;
+            message->sender_id_ = td::td_api::make_object<td::td_api::messageSenderUser>(
+                    MOCK_FIRST_SENDER_ID + (std::int64_t)(rng()%MOCK_SENDER_COUNT));
+            message->date_ = (std::int32_t)time(0);
+            message->content_ = td::td_api::make_object<td::td_api::messageText>(
+                    td::td_api::make_object<td::td_api::formattedText>(a.text, std::vector<td::td_api::object_ptr<td::td_api::textEntity>>()),
+                    nullptr, nullptr);
+            arrival_times[message->id_] = a.t;
+            next_arrival += 1;
+
+            respond(0, td::td_api::make_object<td::td_api::updateNewMessage>(std::move(message)));
+        }
+
+        if (responses.empty()) return {0, 0, nullptr};
+
+        td::ClientManager::Response resp = std::move(responses.front());
+        responses.pop_front();
+        return resp;
+    }
+
+    virtual bool done() override
+    {
+        return next_arrival == arrivals.size() && responses.empty();
+    }
+
+    virtual void finish() override
+    {
+        fclose(record);
+
+        std::sort(latencies.begin(), latencies.end());
+        printf("Mock: delivered %zu messages in %.1fs, %zu replies recorded into %s\n",
+               next_arrival, now_seconds() - t_start, latencies.size(), config.record_path);
+        if (!latencies.empty()) {
+            printf("Mock: reply latency p50 %.1fms, p99 %.1fms, max %.1fms\n",
+                   latencies[latencies.size()/2]*1000.0,
+                   latencies[(latencies.size() - 1)*99/100]*1000.0,
+                   latencies.back()*1000.0);
+        }
+    }
+};
+
+#endif // TRANSPORT_H_
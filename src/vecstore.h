@@ -0,0 +1,598 @@
+#ifndef VECSTORE_H_
+#define VECSTORE_H_
+
+// Append-only store of int8-quantized unit vectors with an IVF index.
+//
+// Files of a store with prefix `p`:
+//   p.vec  header + fixed-size records {int8 vector[padded dim], meta}, mmapped for search
+//   p.txt  texts of the records, appended
+//   p.ivc  IVF centroids, rewritten on every (re)training
+//   p.ivl  IVF list of every record, uint32 per record, appended
+// Without a prefix the same records live on the heap.
+//
+// Below VEC_IVF_MIN_TRAIN records search is a brute-force scan. After that
+// the records are clustered into ~sqrt(n) lists and a search scans only the
+// VEC_IVF_NPROBE closest lists. The index is retrained (and all records are
+// reassigned) every time the store grows VEC_IVF_RETRAIN_FACTOR times, by the
+// owner of the store calling `train` once `train_due`, off the reply path.
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#define VEC_STORE_MAGIC           0x53564754 // "TGVS"
+#define VEC_STORE_VERSION         1
+#define VEC_STORE_HEADER_SIZE     64
+#define VEC_STORE_ALIGN           32
+#define VEC_IVF_MIN_TRAIN         1024
+#define VEC_IVF_RETRAIN_FACTOR    8
+#define VEC_IVF_MIN_LISTS         16
+#define VEC_IVF_MAX_LISTS         2048
+#define VEC_IVF_SAMPLES_PER_LIST  32
+#define VEC_IVF_KMEANS_ITERS      8
+#define VEC_IVF_NPROBE            16
+
+#define VEC_ROLE_USER      0
+#define VEC_ROLE_ASSISTANT 1
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("avx2,fma")))
+static inline float dot_f32_avx2(const float *a, const float *b, size_t n)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i),     _mm256_loadu_ps(b + i),     acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    }
+
+    __m256 acc = _mm256_add_ps(acc0, acc1);
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+
+    float res = _mm_cvtss_f32(sum);
+    for (; i < n; i++) res += a[i]*b[i];
+    return res;
+}
+
+// `n` must be a multiple of VEC_STORE_ALIGN
+__attribute__((target("avx2")))
+static inline std::int32_t dot_i8_avx2(const std::int8_t *a, const std::int8_t *b, size_t n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    for (size_t i = 0; i < n; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        __m256i lo = _mm256_madd_epi16(_mm256_cvtepi8_epi16(_mm256_castsi256_si128(va)),
+                                       _mm256_cvtepi8_epi16(_mm256_castsi256_si128(vb)));
+        __m256i hi = _mm256_madd_epi16(_mm256_cvtepi8_epi16(_mm256_extracti128_si256(va, 1)),
+                                       _mm256_cvtepi8_epi16(_mm256_extracti128_si256(vb, 1)));
+        acc = _mm256_add_epi32(acc, _mm256_add_epi32(lo, hi));
+    }
+
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum);
+}
+
+static inline bool cpu_has_avx2()
+{
+    static const bool has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return has_avx2;
+}
+#endif
+
+static inline float dot_f32_scalar(const float *a, const float *b, size_t n)
+{
+    float acc[4] = {0};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc[0] += a[i]*b[i];
+        acc[1] += a[i+1]*b[i+1];
+        acc[2] += a[i+2]*b[i+2];
+        acc[3] += a[i+3]*b[i+3];
+    }
+    for (; i < n; i++) acc[0] += a[i]*b[i];
+    return acc[0] + acc[1] + acc[2] + acc[3];
+}
+
+static inline std::int32_t dot_i8_scalar(const std::int8_t *a, const std::int8_t *b, size_t n)
+{
+    std::int32_t acc = 0;
+    for (size_t i = 0; i < n; i++) acc += (std::int32_t)a[i]*b[i];
+    return acc;
+}
+
+static inline float dot_f32(const float *a, const float *b, size_t n)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpu_has_avx2()) return dot_f32_avx2(a, b, n);
+#endif
+    return dot_f32_scalar(a, b, n);
+}
+
+static inline std::int32_t dot_i8(const std::int8_t *a, const std::int8_t *b, size_t n)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpu_has_avx2()) return dot_i8_avx2(a, b, n);
+#endif
+    return dot_i8_scalar(a, b, n);
+}
+
+// Symmetric quantization, returns the scale. `out` has `padded` elements
+static inline float quantize_i8(const float *v, size_t n, std::int8_t *out, size_t padded)
+{
+    float max = 0.0f;
+    for (size_t i = 0; i < n; i++) max = std::max(max, fabsf(v[i]));
+    float scale = max > 0.0f ? max/127.0f : 1.0f;
+    for (size_t i = 0; i < n; i++) out[i] = (std::int8_t)lrintf(v[i]/scale);
+    for (size_t i = n; i < padded; i++) out[i] = 0;
+    return scale;
+}
+
+struct Vec_Hit {
+    size_t index;
+    float score;
+};
+
+// Keeps `hits` sorted by score, best first, at most `k` long
+static inline void vec_hits_push(std::vector<Vec_Hit> &hits, size_t k, size_t index, float score)
+{
+    if (hits.size() == k && score <= hits.back().score) return;
+
+    size_t j = hits.size() < k ? hits.size() : k - 1;
+    if (hits.size() < k) hits.push_back({});
+    for (; j > 0 && hits[j-1].score < score; j--) hits[j] = hits[j-1];
+    hits[j] = {index, score};
+}
+
+struct Vec_Header {
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t dim;
+    std::uint32_t record_size;
+};
+
+// Follows the padded vector in every record
+struct Vec_Meta {
+    float scale;
+    std::uint32_t role;
+    std::uint64_t text_offset;
+    std::uint32_t text_size;
+    std::uint32_t reserved;
+};
+
+struct Vec_Store {
+    size_t dim = 0;
+    size_t padded_dim = 0;
+    size_t record_size = 0;
+    size_t count = 0;
+
+    std::string prefix;
+    int vec_fd = -1;
+    int txt_fd = -1;
+    int ivl_fd = -1;
+    std::uint8_t *map = nullptr;
+    size_t map_size = 0;
+    std::uint64_t text_size = 0;
+
+    // Used instead of the files when there is no prefix
+    std::vector<std::uint8_t> heap_records;
+    std::string heap_text;
+
+    std::vector<float> centroids; // n_lists*padded_dim, for training
+    std::vector<std::int8_t> centroids_q;
+    std::vector<float> centroid_scales;
+    std::vector<std::vector<std::uint32_t>> lists;
+    size_t next_train = VEC_IVF_MIN_TRAIN;
+
+    std::vector<std::int8_t> query_q;
+    std::vector<Vec_Hit> probes;
+
+    bool is_on_disk() const { return vec_fd >= 0; }
+
+    static bool write_all(int fd, const void *data, size_t size, off_t offset, const char *path)
+    {
+        const char *buf = (const char *)data;
+        while (size > 0) {
+            ssize_t n = pwrite(fd, buf, size, offset);
+            if (n < 0) {
+                fprintf(stderr, "ERROR: Could not write into file %s: %s\n", path, strerror(errno));
+                return false;
+            }
+            size -= n;
+            buf += n;
+            offset += n;
+        }
+        return true;
+    }
+
+    static bool read_all(int fd, void *data, size_t size, off_t offset, const char *path)
+    {
+        char *buf = (char *)data;
+        while (size > 0) {
+            ssize_t n = pread(fd, buf, size, offset);
+            if (n <= 0) {
+                fprintf(stderr, "ERROR: Could not read file %s: %s\n", path, n == 0 ? "unexpected end of file" : strerror(errno));
+                return false;
+            }
+            size -= n;
+            buf += n;
+            offset += n;
+        }
+        return true;
+    }
+
+    static int open_file(const std::string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) fprintf(stderr, "ERROR: Could not open file %s: %s\n", path.c_str(), strerror(errno));
+        return fd;
+    }
+
+    static off_t file_size(int fd)
+    {
+        struct stat st;
+        if (fstat(fd, &st) < 0) return -1;
+        return st.st_size;
+    }
+
+    // `path_prefix` may be null to keep everything on the heap
+    bool open(const char *path_prefix, size_t dimension)
+    {
+        dim = dimension;
+        padded_dim = (dim + VEC_STORE_ALIGN - 1)/VEC_STORE_ALIGN*VEC_STORE_ALIGN;
+        record_size = (padded_dim + sizeof(Vec_Meta) + VEC_STORE_ALIGN - 1)/VEC_STORE_ALIGN*VEC_STORE_ALIGN;
+        query_q.resize(padded_dim);
+
+        if (path_prefix == nullptr) return true;
+        prefix = path_prefix;
+
+        std::string vec_path = prefix + ".vec";
+        vec_fd = open_file(vec_path);
+        txt_fd = open_file(prefix + ".txt");
+        ivl_fd = open_file(prefix + ".ivl");
+        if (vec_fd < 0 || txt_fd < 0 || ivl_fd < 0) return false;
+
+        off_t size = file_size(vec_fd);
+        if (size == 0) {
+            std::uint8_t header[VEC_STORE_HEADER_SIZE] = {0};
+            Vec_Header h = {VEC_STORE_MAGIC, VEC_STORE_VERSION, (std::uint32_t)dim, (std::uint32_t)record_size};
+            memcpy(header, &h, sizeof(h));
+            if (!write_all(vec_fd, header, sizeof(header), 0, vec_path.c_str())) return false;
+            size = sizeof(header);
+        }
+
+        Vec_Header h;
+        if (!read_all(vec_fd, &h, sizeof(h), 0, vec_path.c_str())) return false;
+        if (h.magic != VEC_STORE_MAGIC || h.version != VEC_STORE_VERSION) {
+            fprintf(stderr, "ERROR: %s is not a vector store\n", vec_path.c_str());
+            return false;
+        }
+        if (h.dim != dim || h.record_size != record_size) {
+            fprintf(stderr, "ERROR: %s holds vectors of dimension %u, expected %zu\n", vec_path.c_str(), h.dim, dim);
+            return false;
+        }
+
+        // A crash in the middle of an append leaves a partial record, drop it
+        count = (size - VEC_STORE_HEADER_SIZE)/record_size;
+        if (ftruncate(vec_fd, VEC_STORE_HEADER_SIZE + count*record_size) < 0) {
+            fprintf(stderr, "ERROR: Could not truncate file %s: %s\n", vec_path.c_str(), strerror(errno));
+            return false;
+        }
+        text_size = file_size(txt_fd);
+
+        if (!map_records(count) || !load_index()) return false;
+        if (count > 0) printf("Opened vector store %s with %zu vectors\n", vec_path.c_str(), count);
+        return true;
+    }
+
+    void close()
+    {
+        if (map != nullptr) munmap(map, map_size);
+        if (vec_fd >= 0) ::close(vec_fd);
+        if (txt_fd >= 0) ::close(txt_fd);
+        if (ivl_fd >= 0) ::close(ivl_fd);
+        map = nullptr;
+        map_size = 0;
+        vec_fd = txt_fd = ivl_fd = -1;
+    }
+
+    // Extends the mapping to the first `n` records, it may reach past the end
+    // of the file, only the pages of existing records are ever touched
+    bool map_records(size_t n)
+    {
+        size_t end = VEC_STORE_HEADER_SIZE + n*record_size;
+        if (!is_on_disk() || end <= map_size) return true;
+
+        // The old mapping stays until the new one exists, the records below
+        // `count` are still read through it when the file can't be mapped
+        size_t size = VEC_STORE_HEADER_SIZE + std::max(2*n, (size_t)VEC_IVF_MIN_TRAIN)*record_size;
+        std::uint8_t *grown = (std::uint8_t *)mmap(nullptr, size, PROT_READ, MAP_SHARED, vec_fd, 0);
+        if (grown == MAP_FAILED) {
+            fprintf(stderr, "ERROR: Could not map %s.vec: %s\n", prefix.c_str(), strerror(errno));
+            return false;
+        }
+        if (map != nullptr) munmap(map, map_size);
+        map = grown;
+        map_size = size;
+        return true;
+    }
+
+    // Only records below `count` are mapped
+    const std::uint8_t *record(size_t i)
+    {
+        if (!is_on_disk()) return &heap_records[i*record_size];
+        return map + VEC_STORE_HEADER_SIZE + i*record_size;
+    }
+
+    const Vec_Meta &meta(size_t i)
+    {
+        return *(const Vec_Meta *)(record(i) + padded_dim);
+    }
+
+    // `v` must be normalized
+    bool append(const float *v, std::uint32_t role, const std::string &text)
+    {
+        std::vector<std::uint8_t> rec(record_size, 0);
+        Vec_Meta m = {};
+        m.scale = quantize_i8(v, dim, (std::int8_t *)rec.data(), padded_dim);
+        m.role = role;
+        m.text_offset = text_size;
+        m.text_size = text.size();
+        memcpy(rec.data() + padded_dim, &m, sizeof(m));
+
+        // Text first, so a record never points past the end of the texts
+        if (is_on_disk()) {
+            if (!write_all(txt_fd, text.data(), text.size(), text_size, (prefix + ".txt").c_str())) return false;
+            if (!write_all(vec_fd, rec.data(), rec.size(), VEC_STORE_HEADER_SIZE + count*record_size, (prefix + ".vec").c_str())) return false;
+        } else {
+            heap_text += text;
+            heap_records.insert(heap_records.end(), rec.begin(), rec.end());
+        }
+        // Unmapped or in no list, the record isn't counted and the next append overwrites it
+        if (!map_records(count + 1)) return false;
+        if (lists.size() > 0 && !assign(count)) return false;
+        text_size += text.size();
+        count += 1;
+        return true;
+    }
+
+    // The index is retrained by the caller when there is time for it, until
+    // then new records go to the closest of the old lists
+    bool train_due() const
+    {
+        return count >= next_train && lists.size() < VEC_IVF_MAX_LISTS;
+    }
+
+    bool read_text(size_t i, std::string &text, std::uint32_t *role)
+    {
+        const Vec_Meta &m = meta(i);
+        *role = m.role;
+        if (!is_on_disk()) {
+            text = heap_text.substr(m.text_offset, m.text_size);
+            return true;
+        }
+        text.resize(m.text_size);
+        return read_all(txt_fd, &text[0], m.text_size, m.text_offset, (prefix + ".txt").c_str());
+    }
+
+    size_t nearest_list(const std::int8_t *v, float scale)
+    {
+        size_t best = 0;
+        float best_score = -INFINITY;
+        for (size_t l = 0; l < lists.size(); l++) {
+            float score = dot_i8(v, &centroids_q[l*padded_dim], padded_dim)*scale*centroid_scales[l];
+            if (score > best_score) {
+                best_score = score;
+                best = l;
+            }
+        }
+        return best;
+    }
+
+    bool assign(size_t i)
+    {
+        std::uint32_t l = nearest_list((const std::int8_t *)record(i), meta(i).scale);
+        if (is_on_disk() && !write_all(ivl_fd, &l, sizeof(l), i*sizeof(l), (prefix + ".ivl").c_str())) return false;
+        lists[l].push_back(i);
+        return true;
+    }
+
+    void quantize_centroids()
+    {
+        size_t n_lists = centroids.size()/padded_dim;
+        centroids_q.resize(centroids.size());
+        centroid_scales.resize(n_lists);
+        for (size_t l = 0; l < n_lists; l++) {
+            centroid_scales[l] = quantize_i8(&centroids[l*padded_dim], padded_dim, &centroids_q[l*padded_dim], padded_dim);
+        }
+    }
+
+    // Spherical k-means over a sample of the records
+    bool train()
+    {
+        size_t n_lists = (size_t)sqrt((double)count);
+        n_lists = std::min(std::max(n_lists, (size_t)VEC_IVF_MIN_LISTS), (size_t)VEC_IVF_MAX_LISTS);
+        n_lists = std::min(n_lists, count);
+
+        size_t n_samples = std::min(count, n_lists*VEC_IVF_SAMPLES_PER_LIST);
+        std::vector<float> samples(n_samples*padded_dim);
+        for (size_t s = 0; s < n_samples; s++) {
+            size_t i = s*count/n_samples;
+            const std::int8_t *v = (const std::int8_t *)record(i);
+            float scale = meta(i).scale;
+            for (size_t d = 0; d < padded_dim; d++) samples[s*padded_dim + d] = v[d]*scale;
+        }
+
+        std::mt19937 rng(count);
+        centroids.resize(n_lists*padded_dim);
+        for (size_t l = 0; l < n_lists; l++) {
+            size_t s = l*n_samples/n_lists;
+            memcpy(&centroids[l*padded_dim], &samples[s*padded_dim], padded_dim*sizeof(float));
+        }
+
+        std::vector<float> sums(n_lists*padded_dim);
+        std::vector<size_t> sizes(n_lists);
+        for (int iter = 0; iter < VEC_IVF_KMEANS_ITERS; iter++) {
+            std::fill(sums.begin(), sums.end(), 0.0f);
+            std::fill(sizes.begin(), sizes.end(), 0);
+            for (size_t s = 0; s < n_samples; s++) {
+                const float *v = &samples[s*padded_dim];
+                size_t best = 0;
+                float best_score = -INFINITY;
+                for (size_t l = 0; l < n_lists; l++) {
+                    float score = dot_f32(v, &centroids[l*padded_dim], padded_dim);
+                    if (score > best_score) {
+                        best_score = score;
+                        best = l;
+                    }
+                }
+                for (size_t d = 0; d < padded_dim; d++) sums[best*padded_dim + d] += v[d];
+                sizes[best] += 1;
+            }
+
+            for (size_t l = 0; l < n_lists; l++) {
+                float *c = &sums[l*padded_dim];
+                if (sizes[l] == 0) {
+                    // Reseed the empty list with a random sample
+                    size_t s = rng()%n_samples;
+                    memcpy(&centroids[l*padded_dim], &samples[s*padded_dim], padded_dim*sizeof(float));
+                    continue;
+                }
+                float norm = sqrtf(dot_f32(c, c, padded_dim));
+                if (norm == 0.0f) norm = 1.0f;
+                for (size_t d = 0; d < padded_dim; d++) centroids[l*padded_dim + d] = c[d]/norm;
+            }
+        }
+        quantize_centroids();
+
+        lists.assign(n_lists, {});
+        std::vector<std::uint32_t> assignments(count);
+        for (size_t i = 0; i < count; i++) {
+            assignments[i] = nearest_list((const std::int8_t *)record(i), meta(i).scale);
+            lists[assignments[i]].push_back(i);
+        }
+        next_train = count*VEC_IVF_RETRAIN_FACTOR;
+
+        if (!is_on_disk()) return true;
+
+        std::string ivc_path = prefix + ".ivc";
+        std::string tmp_path = ivc_path + ".tmp";
+        int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "ERROR: Could not open file %s: %s\n", tmp_path.c_str(), strerror(errno));
+            return false;
+        }
+        std::uint64_t header[2] = {n_lists, count};
+        bool ok = write_all(fd, header, sizeof(header), 0, tmp_path.c_str()) &&
+                  write_all(fd, centroids.data(), centroids.size()*sizeof(float), sizeof(header), tmp_path.c_str());
+        ::close(fd);
+        if (!ok) return false;
+
+        // The lists must match the centroids on disk: write the lists first,
+        // a crash before the rename makes `load_index` reassign everything
+        if (ftruncate(ivl_fd, 0) < 0 ||
+            !write_all(ivl_fd, assignments.data(), assignments.size()*sizeof(std::uint32_t), 0, (prefix + ".ivl").c_str())) {
+            fprintf(stderr, "ERROR: Could not rewrite %s.ivl\n", prefix.c_str());
+            return false;
+        }
+        if (rename(tmp_path.c_str(), ivc_path.c_str()) < 0) {
+            fprintf(stderr, "ERROR: Could not rename %s: %s\n", tmp_path.c_str(), strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    bool load_index()
+    {
+        std::string ivc_path = prefix + ".ivc";
+        int fd = ::open(ivc_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return true;
+
+        // {lists, records trained on}, an index of more records than there are is not ours
+        std::uint64_t header[2];
+        bool ok = read_all(fd, header, sizeof(header), 0, ivc_path.c_str()) &&
+                  header[0] > 0 && header[0] <= VEC_IVF_MAX_LISTS && header[1] <= count;
+        if (ok) {
+            centroids.resize(header[0]*padded_dim);
+            ok = read_all(fd, centroids.data(), centroids.size()*sizeof(float), sizeof(header), ivc_path.c_str());
+        }
+        ::close(fd);
+        if (!ok) {
+            // Searched without the index until there is enough to train it
+            centroids.clear();
+            return count < VEC_IVF_MIN_TRAIN || train();
+        }
+
+        quantize_centroids();
+        lists.assign(header[0], {});
+        next_train = std::max((size_t)header[1]*VEC_IVF_RETRAIN_FACTOR, (size_t)VEC_IVF_MIN_TRAIN);
+
+        // Records appended after the last write of the lists are assigned again
+        size_t n_assigned = std::min((size_t)(file_size(ivl_fd)/sizeof(std::uint32_t)), count);
+        std::vector<std::uint32_t> assignments(n_assigned);
+        if (!read_all(ivl_fd, assignments.data(), n_assigned*sizeof(std::uint32_t), 0, (prefix + ".ivl").c_str())) return train();
+        for (size_t i = 0; i < n_assigned; i++) {
+            if (assignments[i] >= lists.size()) return train();
+            lists[assignments[i]].push_back(i);
+        }
+        for (size_t i = n_assigned; i < count; i++) {
+            if (!assign(i)) return false;
+        }
+        return true;
+    }
+
+    // Top `k` among the first `n_items` records by cosine similarity, best first.
+    // `query` must be normalized
+    void search(const float *query, size_t n_items, size_t k, std::vector<Vec_Hit> &hits)
+    {
+        hits.clear();
+        if (k == 0) return;
+        n_items = std::min(n_items, count);
+        float query_scale = quantize_i8(query, dim, query_q.data(), padded_dim);
+
+        if (lists.size() == 0) {
+            for (size_t i = 0; i < n_items; i++) {
+                float score = dot_i8(query_q.data(), (const std::int8_t *)record(i), padded_dim)*query_scale*meta(i).scale;
+                vec_hits_push(hits, k, i, score);
+            }
+            return;
+        }
+
+        size_t n_probe = std::min((size_t)VEC_IVF_NPROBE, lists.size());
+        probes.clear();
+        for (size_t l = 0; l < lists.size(); l++) {
+            float score = dot_i8(query_q.data(), &centroids_q[l*padded_dim], padded_dim)*centroid_scales[l];
+            vec_hits_push(probes, n_probe, l, score);
+        }
+
+        for (const Vec_Hit &probe : probes) {
+            for (std::uint32_t i : lists[probe.index]) {
+                if (i >= n_items) continue;
+                float score = dot_i8(query_q.data(), (const std::int8_t *)record(i), padded_dim)*query_scale*meta(i).scale;
+                vec_hits_push(hits, k, i, score);
+            }
+        }
+    }
+};
+
+#endif // VECSTORE_H_